@@ -0,0 +1,450 @@
+// loadgen.cpp
+// ===========
+// Load generator for a running sgs. Simulated players connect over raw uSockets, fill lobbies,
+// exchange timestamped data messages at a fixed rate and report throughput and one-way relay latency.
+// The server's max_players/max_lobbies/max_players_per_lobby must allow the requested load.
+//
+// Usage: bench/loadgen [--host 127.0.0.1] [--port 3000] [--lobbies 10] [--lobby-size 8] [--rate 20]
+//                      [--payload 64] [--warmup 2] [--duration 10] [--threads 1] [--game bench] [--senders all]
+//
+// Large lobby scenario (game "bench-large" listed in config::large_lobbies), one audience of 5000 at 20 Hz:
+//   bench/loadgen --lobbies 1 --lobby-size 5000 --rate 20 --senders leader --game bench-large --threads 4
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "libusockets.h"
+#include "../json.hpp"
+#include "../metrics.hpp"
+
+
+using nlohmann::json;
+
+struct Options {
+	std::string host = "127.0.0.1";
+	int port = 3000;
+	unsigned lobbies = 10;  // Lobbies in total
+	unsigned lobby_size = 8;  // Players per lobby, including the leader
+	unsigned rate = 20;  // Messages per second sent by every player
+	unsigned payload = 64;  // Padding bytes per message
+	unsigned warmup = 2;  // Seconds of traffic before measuring
+	unsigned duration = 10;  // Seconds of measured traffic
+	unsigned threads = 1;  // Event loops, players are split between them
+	unsigned connect_timeout = 60;  // Seconds allowed for all players to join
+	std::string game = "bench";  // Game of the lobbies
+	bool leader_only = false;  // Only leaders send ("--senders leader"), members just receive
+};
+
+enum class Phase {
+	CONNECTING,  // Players connect and join lobbies
+	WARMUP,  // Traffic is sent but not measured
+	MEASURING,
+	DONE
+};
+
+// State shared by all workers
+struct Shared {
+	size_t num_players;  // Players in total
+	std::atomic<size_t> num_joined = 0;  // Players in their lobby
+	std::atomic<uint64_t> traffic_start = 0;  // now_ns() once every player joined, 0 before
+	std::unique_ptr<std::atomic<bool>[]> lobby_created;  // True once the leader of lobby i created it
+
+	explicit Shared(const Options &options)
+			: num_players(options.lobbies * options.lobby_size), lobby_created(new std::atomic<bool>[options.lobbies]) {
+		for (unsigned i = 0; i < options.lobbies; i++) this->lobby_created[i] = false;
+	}
+};
+
+struct Worker;
+
+// Simulated player
+struct Client {
+	Worker *worker = nullptr;
+	us_socket_t *socket = nullptr;  // nullptr while not connected
+	unsigned lobby = 0;  // Index of lobby
+	bool leader = false;  // Creates the lobby, members connect once it exists
+	bool upgraded = false;  // True once the websocket handshake completed
+	bool joined = false;  // True once in the lobby
+	bool connecting = false;  // True once a connection was started
+	std::string input;  // Received bytes not parsed yet
+	std::string output;  // Bytes the socket did not accept yet
+};
+
+// Event loop thread with its share of the players. Players are dealt round-robin to workers,
+// so a single large lobby is spread over all of them.
+struct Worker {
+	const Options *options;
+	Shared *shared;
+	us_loop_t *loop = nullptr;
+	us_socket_context_t *context = nullptr;
+	us_timer_t *timer = nullptr;
+	std::vector<Client> clients;
+	Phase phase = Phase::CONNECTING;
+	uint64_t start = 0;  // now_ns() when the worker started
+	std::string padding;
+	uint64_t sent = 0;  // Messages sent while measuring
+	uint64_t received = 0;  // Messages received while measuring
+	uint64_t bytes_received = 0;
+	uint64_t errors = 0;  // Error replies and lost connections
+	Histogram latency;  // One-way relay latency in nanoseconds
+
+	// Worker index of num_workers, taking every num_workers-th player
+	Worker(const Options *options, Shared *shared, unsigned index, unsigned num_workers)
+			: options(options), shared(shared), padding(options->payload, 'x') {
+		for (size_t player = index; player < shared->num_players; player += num_workers) {
+			Client client;
+			client.worker = this;
+			client.lobby = static_cast<unsigned>(player / options->lobby_size);
+			client.leader = (player % options->lobby_size == 0);
+			this->clients.push_back(std::move(client));
+		}
+	}
+
+	std::string lobby_name(unsigned lobby) const {
+		return "bench-" + std::to_string(getpid()) + "-" + std::to_string(lobby);
+	}
+
+	void connect(Client *client) {
+		client->connecting = true;
+		auto *socket = us_socket_context_connect(0, this->context, this->options->host.c_str(), this->options->port, nullptr, 0, sizeof(Client *));
+		if (!socket) {
+			this->errors++;
+			return;
+		}
+		*(Client **) us_socket_ext(0, socket) = client;
+		client->socket = socket;
+	}
+
+	// Write bytes, buffering what the socket does not take
+	void write(Client *client, std::string_view data) {
+		if (!client->socket) return;
+		if (!client->output.empty()) {
+			client->output.append(data);
+			return;
+		}
+		int written = us_socket_write(0, client->socket, data.data(), static_cast<int>(data.size()), 0);
+		if (written < static_cast<int>(data.size())) {
+			client->output.append(data.substr(std::max(written, 0)));
+		}
+	}
+
+	// Send text frame. Client frames must be masked; a zero key leaves the payload as is.
+	void send_text(Client *client, std::string_view payload) {
+		char header[14];
+		size_t length = payload.size();
+		size_t n = 0;
+		header[n++] = (char) 0x81;
+		if (length < 126) {
+			header[n++] = (char) (0x80 | length);
+		} else if (length <= 0xffff) {
+			header[n++] = (char) (0x80 | 126);
+			header[n++] = (char) (length >> 8);
+			header[n++] = (char) length;
+		} else {
+			header[n++] = (char) (0x80 | 127);
+			for (int shift = 56; shift >= 0; shift -= 8) header[n++] = (char) (length >> shift);
+		}
+		memset(header + n, 0, 4);
+		n += 4;
+		std::string frame(header, n);
+		frame.append(payload);
+		this->write(client, frame);
+	}
+
+	void send_join(Client *client) {
+		json join = {
+			{"type", "data"},
+			{"lobby", this->lobby_name(client->lobby)},
+			{"game", this->options->game},
+			{"data", json::object()}
+		};
+		this->send_text(client, join.dump());
+	}
+
+	void send_timestamped(Client *client) {
+		std::string message = "{\"type\":\"data\",\"lobby\":\"";
+		message.append(this->lobby_name(client->lobby));
+		message.append("\",\"data\":{\"t\":").append(std::to_string(now_ns()));
+		message.append(",\"pad\":\"").append(this->padding).append("\"}}");
+		this->send_text(client, message);
+		if (this->phase == Phase::MEASURING) this->sent++;
+	}
+
+	void on_message(Client *client, std::string_view message) {
+		if (message.find("\"type\":\"data\"") != std::string_view::npos) {
+			size_t t = message.find("\"t\":");
+			if (t == std::string_view::npos) return;  // Initialization data
+			uint64_t sent_at = strtoull(message.data() + t + 4, nullptr, 10);
+			if (this->phase == Phase::MEASURING) {
+				uint64_t now = now_ns();
+				this->latency.record(now > sent_at ? now - sent_at : 0);
+				this->received++;
+				this->bytes_received += message.size();
+			}
+		} else if (message.find("\"type\":\"connected\"") != std::string_view::npos) {
+			this->send_join(client);
+		} else if (message.find("\"type\":\"success\"") != std::string_view::npos) {
+			if (client->joined) return;  // Leadership change
+			client->joined = true;
+			this->shared->num_joined++;
+			if (client->leader) {
+				this->shared->lobby_created[client->lobby] = true;  // Members connect on their workers' next tick
+			}
+		} else if (message.find("\"type\":\"error\"") != std::string_view::npos) {
+			fprintf(stderr, "Lobby request rejected by server (check its limits)\n");
+			this->errors++;
+		}
+	}
+
+	// Parse complete frames from client->input
+	void on_data(Client *client, std::string_view data) {
+		client->input.append(data);
+		size_t offset = 0;
+		if (!client->upgraded) {
+			size_t end = client->input.find("\r\n\r\n");
+			if (end == std::string::npos) return;
+			if (client->input.compare(0, 12, "HTTP/1.1 101") != 0) {
+				fprintf(stderr, "Websocket upgrade rejected: %.*s\n", (int) client->input.find("\r\n"), client->input.data());
+				this->errors++;
+				us_socket_close(0, client->socket, 0, nullptr);
+				return;
+			}
+			client->upgraded = true;
+			offset = end + 4;
+		}
+
+		const auto *bytes = reinterpret_cast<const unsigned char *>(client->input.data());
+		while (client->input.size() - offset >= 2) {
+			unsigned opcode = bytes[offset] & 0x0f;
+			bool masked = bytes[offset + 1] & 0x80;
+			uint64_t length = bytes[offset + 1] & 0x7f;
+			size_t header = 2;
+			if (length == 126) {
+				if (client->input.size() - offset < 4) break;
+				length = (uint64_t(bytes[offset + 2]) << 8) | bytes[offset + 3];
+				header = 4;
+			} else if (length == 127) {
+				if (client->input.size() - offset < 10) break;
+				length = 0;
+				for (int i = 0; i < 8; i++) length = (length << 8) | bytes[offset + 2 + i];
+				header = 10;
+			}
+			if (masked) header += 4;  // Servers do not mask, skipped for completeness
+			if (client->input.size() - offset < header + length) break;
+
+			std::string_view payload(client->input.data() + offset + header, length);
+			offset += header + length;
+			if (opcode == 1 || opcode == 2) {
+				this->on_message(client, payload);
+			} else if (opcode == 9) {
+				// Answer ping with pong carrying the same payload
+				std::string pong = "\x8a";
+				pong.push_back((char) (0x80 | payload.size()));
+				pong.append(4, '\0');
+				pong.append(payload);
+				this->write(client, pong);
+			} else if (opcode == 8) {
+				us_socket_close(0, client->socket, 0, nullptr);
+				return;
+			}
+		}
+		client->input.erase(0, offset);
+	}
+
+	// Timer tick: connect members of created lobbies, advance phases and send one message per player.
+	// Phases follow the shared traffic start, so every worker measures the same window.
+	void tick() {
+		if (this->phase == Phase::DONE) return;
+		uint64_t now = now_ns();
+		uint64_t traffic_start = this->shared->traffic_start;
+		if (traffic_start == 0) {
+			for (auto &client : this->clients) {
+				if (!client.connecting && this->shared->lobby_created[client.lobby]) {
+					this->connect(&client);
+				}
+			}
+			if (this->shared->num_joined == this->shared->num_players) {
+				this->shared->traffic_start.compare_exchange_strong(traffic_start, now);
+			} else if (now - this->start > this->options->connect_timeout * 1000000000ull) {
+				fprintf(stderr, "Only %zu of %zu players joined\n", this->shared->num_joined.load(), this->shared->num_players);
+				this->errors++;
+				this->stop();
+			}
+			return;
+		}
+
+		uint64_t elapsed = now - traffic_start;
+		if (elapsed >= (this->options->warmup + this->options->duration) * 1000000000ull) {
+			this->stop();
+			return;
+		}
+		this->phase = (elapsed >= this->options->warmup * 1000000000ull) ? Phase::MEASURING : Phase::WARMUP;
+		for (auto &client : this->clients) {
+			if (client.joined && client.socket && (client.leader || !this->options->leader_only)) {
+				this->send_timestamped(&client);
+			}
+		}
+	}
+
+	// Close everything so the loop returns
+	void stop() {
+		this->phase = Phase::DONE;
+		us_timer_close(this->timer);
+		for (auto &client : this->clients) {
+			if (client.socket) us_socket_close(0, client.socket, 0, nullptr);
+		}
+	}
+
+	void run() {
+		this->loop = us_create_loop(nullptr, [](us_loop_t *) {}, [](us_loop_t *) {}, [](us_loop_t *) {}, 0);
+		this->context = us_create_socket_context(0, this->loop, sizeof(Worker *), {});
+		*(Worker **) us_socket_context_ext(0, this->context) = this;
+
+		us_socket_context_on_open(0, this->context, [](us_socket_t *s, int is_client, char *ip, int ip_length) {
+			auto *client = *(Client **) us_socket_ext(0, s);
+			std::string request = "GET /game_server HTTP/1.1\r\n"
+				"Host: " + client->worker->options->host + "\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Key: c2dzLWxvYWRnZW4tYmVuY2g=\r\n"
+				"Sec-WebSocket-Version: 13\r\n\r\n";
+			client->worker->write(client, request);
+			return s;
+		});
+		us_socket_context_on_data(0, this->context, [](us_socket_t *s, char *data, int length) {
+			auto *client = *(Client **) us_socket_ext(0, s);
+			client->worker->on_data(client, std::string_view(data, length));
+			return s;
+		});
+		us_socket_context_on_writable(0, this->context, [](us_socket_t *s) {
+			auto *client = *(Client **) us_socket_ext(0, s);
+			if (!client->output.empty()) {
+				int written = us_socket_write(0, s, client->output.data(), static_cast<int>(client->output.size()), 0);
+				client->output.erase(0, std::max(written, 0));
+			}
+			return s;
+		});
+		us_socket_context_on_close(0, this->context, [](us_socket_t *s, int code, void *reason) {
+			auto *client = *(Client **) us_socket_ext(0, s);
+			client->socket = nullptr;
+			if (client->worker->phase != Phase::DONE) {
+				fprintf(stderr, "Connection lost\n");
+				client->worker->errors++;
+			}
+			return s;
+		});
+		us_socket_context_on_end(0, this->context, [](us_socket_t *s) {
+			return us_socket_close(0, s, 0, nullptr);
+		});
+		us_socket_context_on_timeout(0, this->context, [](us_socket_t *s) { return s; });
+		us_socket_context_on_connect_error(0, this->context, [](us_socket_t *s, int code) {
+			auto *client = *(Client **) us_socket_ext(0, s);
+			client->socket = nullptr;
+			fprintf(stderr, "Could not connect\n");
+			client->worker->errors++;
+			return s;
+		});
+
+		unsigned tick_ms = std::max(1u, 1000 / std::max(1u, this->options->rate));
+		this->timer = us_create_timer(this->loop, 0, sizeof(Worker *));
+		*(Worker **) us_timer_ext(this->timer) = this;
+		us_timer_set(this->timer, [](us_timer_t *t) {
+			(*(Worker **) us_timer_ext(t))->tick();
+		}, tick_ms, tick_ms);
+
+		this->start = now_ns();
+		for (auto &client : this->clients) {
+			if (client.leader) this->connect(&client);
+		}
+		us_loop_run(this->loop);
+		us_socket_context_free(0, this->context);
+		us_loop_free(this->loop);
+	}
+};
+
+void usage() {
+	fprintf(stderr, "Usage: loadgen [--host H] [--port P] [--lobbies N] [--lobby-size N] [--rate HZ] "
+		"[--payload BYTES] [--warmup S] [--duration S] [--threads N] [--game NAME] [--senders all|leader]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		if (i + 1 >= argc) usage();
+		std::string value = argv[++i];
+		if (option == "--host") options.host = value;
+		else if (option == "--port") options.port = std::stoi(value);
+		else if (option == "--lobbies") options.lobbies = std::stoul(value);
+		else if (option == "--lobby-size") options.lobby_size = std::stoul(value);
+		else if (option == "--rate") options.rate = std::stoul(value);
+		else if (option == "--payload") options.payload = std::stoul(value);
+		else if (option == "--warmup") options.warmup = std::stoul(value);
+		else if (option == "--duration") options.duration = std::stoul(value);
+		else if (option == "--threads") options.threads = std::stoul(value);
+		else if (option == "--game") options.game = value;
+		else if (option == "--senders" && (value == "all" || value == "leader")) options.leader_only = (value == "leader");
+		else usage();
+	}
+	if (options.lobbies == 0 || options.lobby_size < 2 || options.threads == 0) usage();
+	options.threads = std::min(options.threads, options.lobbies * options.lobby_size);
+
+	Shared shared(options);
+	std::vector<std::unique_ptr<Worker>> workers;
+	for (unsigned i = 0; i < options.threads; i++) {
+		workers.push_back(std::make_unique<Worker>(&options, &shared, i, options.threads));
+	}
+	std::vector<std::thread> threads;
+	for (auto &worker : workers) {
+		threads.emplace_back([&worker]() { worker->run(); });
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	Histogram latency;
+	uint64_t sent = 0, received = 0, bytes_received = 0, errors = 0;
+	for (auto &worker : workers) {
+		latency.merge(worker->latency);
+		sent += worker->sent;
+		received += worker->received;
+		bytes_received += worker->bytes_received;
+		errors += worker->errors;
+	}
+	double seconds = options.duration;
+	auto microseconds = [&](double q) { return latency.quantile(q) / 1000.0; };
+	json report = {
+		{"players", options.lobbies * options.lobby_size},
+		{"lobbies", options.lobbies},
+		{"game", options.game},
+		{"senders", options.leader_only ? "leader" : "all"},
+		{"rate", options.rate},
+		{"payload", options.payload},
+		{"duration", options.duration},
+		{"sent", sent},
+		{"received", received},
+		{"sent_per_second", sent / seconds},
+		{"received_per_second", received / seconds},
+		{"received_mb_per_second", bytes_received / seconds / 1e6},
+		{"latency_us", {
+			{"p50", microseconds(0.5)},
+			{"p99", microseconds(0.99)},
+			{"p999", microseconds(0.999)},
+			{"max", microseconds(1.0)}
+		}},
+		{"errors", errors}
+	};
+	printf("%s\n", report.dump(2).c_str());
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+// microbench.cpp
+// ==============
+// Microbenchmarks of the per-message json work done by server.cpp, on a fixed payload corpus.
+// Results are printed as json so runs on different commits can be compared directly.
+//
+// Usage: bench/microbench [--filter <substring>] [--samples 15] [--sample-ms 20]
+
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../json.hpp"
+
+#include "../config.hpp"
+#include "../encoding.hpp"
+#include "../envelope.hpp"
+
+
+using nlohmann::json;
+
+// Keep value alive so the computation producing it is not optimized away
+template <typename T>
+inline void keep(const T &value) {
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Payloads measured by every per-message case
+struct Payload {
+	std::string name;
+	std::string text;  // Json as sent by clients
+};
+
+// Fixed corpus. Never change existing entries, results are compared across commits by name.
+std::vector<Payload> corpus() {
+	std::vector<Payload> payloads = {
+		{"join", R"({"type":"data","lobby":"lobby-1","game":"shooter","data":{}})"},
+		{"small", R"({"type":"data","lobby":"lobby-1","game":"shooter","data":{"x":12.5,"y":-3.25,"angle":90,"id":42}})"},
+		{"increment", R"({"type":"data","lobby":"lobby-1","game":"increment","data":{"value":41}})"}
+	};
+
+	// Leader state update with 32 entities
+	json entities = json::array();
+	for (int i = 0; i < 32; i++) {
+		entities.push_back({
+			{"id", i},
+			{"x", i * 1.5},
+			{"y", i * -0.75},
+			{"hp", 100 - i},
+			{"name", "entity-" + std::to_string(i)}
+		});
+	}
+	json large = {
+		{"type", "data"},
+		{"lobby", "lobby-1"},
+		{"game", "shooter"},
+		{"data", {{"tick", 1234}, {"entities", entities}}}
+	};
+	payloads.push_back({"large", large.dump()});
+	return payloads;
+}
+
+struct Result {
+	std::string name;
+	uint64_t iterations;  // Iterations per sample
+	double median_ns;  // Median time per iteration
+	double min_ns;  // Fastest sample, per iteration
+};
+
+struct Bench {
+	std::string filter;
+	unsigned samples = 15;
+	unsigned sample_ms = 20;
+	std::vector<Result> results;
+
+	static double now_ns() {
+		return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Time f. Iterations per sample are calibrated so a sample takes about sample_ms.
+	void run(const std::string &name, const std::function<void()> &f) {
+		if (!this->filter.empty() && name.find(this->filter) == std::string::npos) return;
+
+		uint64_t iterations = 1;
+		while (true) {
+			double start = now_ns();
+			for (uint64_t i = 0; i < iterations; i++) f();
+			double elapsed = now_ns() - start;
+			if (elapsed >= this->sample_ms * 1e6 || iterations >= (uint64_t(1) << 40)) break;
+			iterations *= (elapsed < this->sample_ms * 1e5) ? 10 : 2;
+		}
+
+		std::vector<double> per_iteration;
+		for (unsigned s = 0; s < this->samples; s++) {
+			double start = now_ns();
+			for (uint64_t i = 0; i < iterations; i++) f();
+			per_iteration.push_back((now_ns() - start) / iterations);
+		}
+		std::sort(per_iteration.begin(), per_iteration.end());
+		this->results.push_back({name, iterations, per_iteration[per_iteration.size() / 2], per_iteration.front()});
+	}
+};
+
+int main(int argc, char **argv) {
+	Bench bench;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string option = argv[i];
+		if (option == "--filter") bench.filter = argv[i + 1];
+		else if (option == "--samples") bench.samples = std::max(1, atoi(argv[i + 1]));
+		else if (option == "--sample-ms") bench.sample_ms = std::max(1, atoi(argv[i + 1]));
+		else {
+			fprintf(stderr, "Usage: microbench [--filter <substring>] [--samples N] [--sample-ms MS]\n");
+			return 1;
+		}
+	}
+
+	const json EMPTY_JSON = json::object();
+	const json SUCCESS = {
+		{"type", "success"},
+		{"data", EMPTY_JSON}
+	};
+
+	for (const auto &payload : corpus()) {
+		const json parsed = json::parse(payload.text);
+
+		// Parsing the whole message
+		bench.run("parse/" + payload.name, [&]() {
+			json message = json::parse(payload.text);
+			keep(message);
+		});
+
+		// Envelope lookups on a parsed message
+		bench.run("value/" + payload.name, [&]() {
+			std::string lobby_name = parsed.value("lobby", "");
+			std::string game_name = parsed.value("game", "");
+			std::string message_type = parsed.value("type", "error");
+			keep(lobby_name);
+			keep(game_name);
+			keep(message_type);
+		});
+
+		// Envelope scan used for relaying, per encoding
+		for (size_t e = 0; e < NUM_ENCODINGS; e++) {
+			auto encoding = static_cast<Encoding>(e);
+			std::string encoded = encode(parsed, encoding);
+			bench.run("scan_envelope/" + payload.name + "/" + std::string(ENCODING_PROTOCOLS[e]), [&]() {
+				Envelope envelope;
+				bool valid = scan_envelope(encoded, encoding, envelope);
+				keep(valid);
+				keep(envelope);
+			});
+		}
+
+		// Serializing the whole message
+		bench.run("dump/" + payload.name, [&]() {
+			std::string dumped = parsed.dump();
+			keep(dumped);
+		});
+
+		// Relay to a player using another encoding
+		bench.run("transcode/" + payload.name + "/sgs.msgpack", [&]() {
+			TranscodedMessage transcoded(payload.text, Encoding::JSON);
+			auto converted = transcoded[Encoding::MSGPACK];
+			keep(converted);
+		});
+	}
+
+	// Game processor of the "increment" game, including the decode/encode around it
+	const std::string increment_text = R"({"type":"data","lobby":"lobby-1","game":"increment","data":{"value":41}})";
+	const json increment_message = json::parse(increment_text);
+	ProcessorId increment = config::GameProcessors::find("increment");
+	bench.run("process/increment", [&]() {
+		json processed = increment_message;
+		config::GameProcessors::process(increment, processed);
+		keep(processed);
+	});
+	bench.run("process/increment/roundtrip", [&]() {
+		json message = decode(increment_text, Encoding::JSON);
+		config::GameProcessors::process(increment, message);
+		std::string processed = encode(message, Encoding::JSON);
+		keep(processed);
+	});
+
+	// Replies built when a player joins
+	for (size_t e = 0; e < NUM_ENCODINGS; e++) {
+		auto encoding = static_cast<Encoding>(e);
+		std::string suffix = (encoding == Encoding::JSON) ? "" : "/" + std::string(ENCODING_PROTOCOLS[e]);
+		bench.run("join/success" + suffix, [&]() {
+			SuccessReply success;
+			success.player_id = 42;
+			success.resume_token = "0123456789abcdef0123456789abcdef";
+			auto reply = encode_success(encoding, "lobby-1", success);
+			keep(reply);
+		});
+	}
+	bench.run("join/success/json_tree", [&]() {
+		json joining_success = SUCCESS;
+		joining_success["data"]["is_leader"] = false;
+		joining_success["data"]["player_id"] = 42;
+		joining_success["data"]["resume_token"] = "0123456789abcdef0123456789abcdef";
+		joining_success["lobby"] = "lobby-1";
+		std::string reply = encode(joining_success, Encoding::JSON);
+		keep(reply);
+	});
+	json initialization_data = json::parse(corpus().back().text)["data"];
+	bench.run("join/data", [&]() {
+		json message = {
+			{"type", "data"},
+			{"lobby", "lobby-1"}
+		};
+		message["data"] = initialization_data;
+		std::string data_message = encode(message, Encoding::JSON);
+		keep(data_message);
+	});
+
+	// Leader updates of initialization data: full replacement versus a one-entity patch
+	const std::string initialization_text = initialization_data.dump();
+	const json entity_patch = json::parse(R"([{"op":"replace","path":"/entities/7/hp","value":12}])");
+	bench.run("initialization/replace", [&]() {
+		json data = json::parse(initialization_text);
+		keep(data);
+	});
+	bench.run("initialization/patch", [&]() {
+		json data = initialization_data.patch(entity_patch);
+		keep(data);
+	});
+
+	json report = {{"benchmarks", json::array()}};
+	for (const auto &result : bench.results) {
+		report["benchmarks"].push_back({
+			{"name", result.name},
+			{"iterations", result.iterations},
+			{"median_ns", result.median_ns},
+			{"min_ns", result.min_ns}
+		});
+	}
+	printf("%s\n", report.dump(2).c_str());
+}
@@ -11,8 +11,11 @@ signal server_connected
 signal server_disconnected
 signal lobby_connected
 signal lobby_disconnected
+signal state_received  # Mirrored lobby state: (type, version, data), type is "state" or "state_patch"
 
 var current_url : String = ""
+var use_msgpack : bool = false  # Request the binary MessagePack encoding on connect
+var msgpack_enabled : bool = false  # True if the server accepted MessagePack for this connection
 
 
 func _ready():
@@ -23,18 +26,41 @@ func _ready():
 
 func _connection_established(proto : String = ""):
 	print("SGS: Connected to server: " + current_url)
+	msgpack_enabled = (proto == "sgs.msgpack")
+	if msgpack_enabled:
+		client.get_peer(1).set_write_mode(WebSocketPeer.WRITE_MODE_BINARY)
+	else:
+		client.get_peer(1).set_write_mode(WebSocketPeer.WRITE_MODE_TEXT)
 	self.connected_to_sgs = true
 	emit_signal("server_connected")
 
 func _data_received():
-	var raw : String = client.get_peer(1).get_packet().get_string_from_utf8()
+	var packet : PoolByteArray = client.get_peer(1).get_packet()
+	var obj : Dictionary
 	
-	var res : JSONParseResult = JSON.parse(raw)
-	if res.error != OK:
-		prints("SGS: Unable to parse data:", raw)
-		return
+	if msgpack_enabled:
+		var decoded = SGSMsgPack.decode(packet)
+		if typeof(decoded) != TYPE_DICTIONARY:
+			prints("SGS: Unable to decode data:", packet)
+			return
+		obj = decoded
+	else:
+		var raw : String = packet.get_string_from_utf8()
+		var res : JSONParseResult = JSON.parse(raw)
+		if res.error != OK:
+			prints("SGS: Unable to parse data:", raw)
+			return
+		obj = res.result
 	
-	var obj : Dictionary = res.result
+	_handle_message(obj)
+
+func _handle_message(obj : Dictionary):
+	if obj.get("type", "error") == "batch":
+		# Member messages collected by the server during one tick
+		for message in obj.get("data", []):
+			if typeof(message) == TYPE_DICTIONARY:
+				_handle_message(message)
+		return
 	
 	if obj.get("type", "error") == "success":
 		if connecting_to_lobby:
@@ -42,6 +68,10 @@ func _data_received():
 			connected_to_lobby = true
 			current_lobby = obj.get("lobby")  # Should always be in packet
 			current_id = obj.get("data", {}).get("player_id", -1)
+			resume_token = obj.get("data", {}).get("resume_token", "")
+			resume_lobby = current_lobby
+			resume_game = current_game
+			resume_id = current_id
 			print("Debug: Set lobby to ", current_lobby)
 			emit_signal("lobby_connected")
 			
@@ -58,6 +88,10 @@ func _data_received():
 	
 	if obj.get("type", "error") == "data":
 		_smart_emit_data_received(obj.get("data", {}))
+	
+	if obj.get("type", "error") in ["state", "state_patch"]:
+		# Keyframe or RFC 6902 patch of the state mirrored by the server
+		emit_signal("state_received", obj.get("type"), obj.get("version", 0), obj.get("data"))
 
 var _queued_data : Array = []
 func _smart_emit_data_received(data : Dictionary):
@@ -94,10 +128,17 @@ func _reset_state_variables():
 	connecting_to_lobby = false
 	connected_to_lobby = false
 	lobby_leader = false
+	msgpack_enabled = false
 	current_lobby = ""
 	current_game = ""
 	current_id = -1
 
+# Kept across disconnects so resume_session() can take the lobby slot back
+var resume_token : String = ""
+var resume_lobby : String = ""
+var resume_game : String = ""
+var resume_id : int = -1
+
 # State variables
 var connected_to_sgs : bool = false
 var connecting_to_lobby : bool = false
@@ -112,7 +153,11 @@ func disconnect_from_server():
 		client.disconnect_from_host()
 
 func connect_to_server(address):
-	var success = client.connect_to_url(address)
+	var protocols : PoolStringArray = PoolStringArray()
+	if use_msgpack:
+		protocols.append("sgs.msgpack")
+		protocols.append("sgs.json")
+	var success = client.connect_to_url(address, protocols)
 	current_url = address
 	connected_to_sgs = false
 	if success != OK:
@@ -142,8 +187,25 @@ func connect_to_lobby(lobby_name, game_name):
 		"lobby": lobby_name,
 		"game": game_name
 	}
-	var jstr = JSON.print(message)
-	client.get_peer(1).put_packet(jstr.to_utf8())
+	_send_message(message)
+
+## Take back the lobby slot of a dropped connection after reconnecting. Must be
+## called within the server's grace period; missed messages are delivered after success.
+func resume_session():
+	if not connected_to_server() or resume_token == "":
+		return false
+	if connecting_to_lobby or in_lobby():
+		return false
+	
+	connecting_to_lobby = true
+	current_game = resume_game
+	var message = {
+		"type": "resume",
+		"data": {"player_id": resume_id, "token": resume_token},
+		"lobby": resume_lobby
+	}
+	_send_message(message)
+	return true
 
 func send_data(obj):
 	if not connected_to_server() or not in_lobby():
@@ -154,8 +216,38 @@ func send_data(obj):
 		"lobby": current_lobby,
 		"game": current_game
 	}
-	var jstr : String = JSON.print(message)
-	client.get_peer(1).put_packet(jstr.to_utf8())
+	_send_message(message)
+	return true
+
+## Send data to the given player ids only. Only honored for the lobby leader,
+## other players' messages always go to the leader.
+func send_to(obj, player_ids : Array):
+	if not connected_to_server() or not in_lobby():
+		return false
+	var message : Dictionary = {
+		"type": "data",
+		"data": obj,
+		"lobby": current_lobby,
+		"game": current_game,
+		"to": player_ids
+	}
+	_send_message(message)
+	return true
+
+## Send data on a latest-wins channel: while a recipient is congested, a newer
+## message on the same channel replaces the one still queued for it.
+func send_latest(obj, channel : int):
+	if not connected_to_server() or not in_lobby():
+		return false
+	var message : Dictionary = {
+		"type": "data",
+		"data": obj,
+		"lobby": current_lobby,
+		"game": current_game,
+		"channel": channel,
+		"delivery": "latest"
+	}
+	_send_message(message)
 	return true
 
 func send_initialization(obj):
@@ -167,10 +259,30 @@ func send_initialization(obj):
 		"lobby": current_lobby,
 		"game": current_game
 	}
-	var jstr : String = JSON.print(message)
-	client.get_peer(1).put_packet(jstr.to_utf8())
+	_send_message(message)
 	return true
 
+## Update the initialization data with an RFC 6902 patch, e.g.
+## [{"op": "replace", "path": "/score", "value": 3}]
+func send_initialization_patch(operations : Array):
+	if not connected_to_server() or not in_lobby() or not is_leader():
+		return false
+	var message : Dictionary = {
+		"type": "initialization_patch",
+		"data": operations,
+		"lobby": current_lobby,
+		"game": current_game
+	}
+	_send_message(message)
+	return true
+
+func _send_message(message : Dictionary):
+	if msgpack_enabled:
+		client.get_peer(1).put_packet(SGSMsgPack.encode(message))
+	else:
+		var jstr : String = JSON.print(message)
+		client.get_peer(1).put_packet(jstr.to_utf8())
+
 func is_leader() -> bool:
 	return (self.lobby_leader and self.connected_to_lobby)
 
@@ -0,0 +1,150 @@
+## SGS MessagePack codec
+### Minimal MessagePack encoder/decoder used by SGSNetwork when the server
+### negotiates the "sgs.msgpack" subprotocol. Extension types are not supported.
+
+extends Reference
+class_name SGSMsgPack
+
+
+static func encode(value) -> PoolByteArray:
+	var buffer : StreamPeerBuffer = StreamPeerBuffer.new()
+	buffer.big_endian = true
+	_encode_value(buffer, value)
+	return buffer.data_array
+
+static func decode(data : PoolByteArray):
+	var buffer : StreamPeerBuffer = StreamPeerBuffer.new()
+	buffer.big_endian = true
+	buffer.data_array = data
+	return _decode_value(buffer)
+
+static func _encode_value(buffer : StreamPeerBuffer, value):
+	match typeof(value):
+		TYPE_NIL:
+			buffer.put_u8(0xc0)
+		TYPE_BOOL:
+			buffer.put_u8(0xc3 if value else 0xc2)
+		TYPE_INT:
+			if value >= 0 and value <= 0x7f:
+				buffer.put_u8(value)
+			elif value < 0 and value >= -32:
+				buffer.put_8(value)
+			elif value >= -0x80000000 and value <= 0x7fffffff:
+				buffer.put_u8(0xd2)
+				buffer.put_32(value)
+			else:
+				buffer.put_u8(0xd3)
+				buffer.put_64(value)
+		TYPE_REAL:
+			buffer.put_u8(0xcb)
+			buffer.put_double(value)
+		TYPE_STRING:
+			var bytes : PoolByteArray = value.to_utf8()
+			var size : int = bytes.size()
+			if size < 32:
+				buffer.put_u8(0xa0 | size)
+			elif size <= 0xff:
+				buffer.put_u8(0xd9)
+				buffer.put_u8(size)
+			elif size <= 0xffff:
+				buffer.put_u8(0xda)
+				buffer.put_u16(size)
+			else:
+				buffer.put_u8(0xdb)
+				buffer.put_u32(size)
+			buffer.put_data(bytes)
+		TYPE_RAW_ARRAY:
+			var size : int = value.size()
+			if size <= 0xff:
+				buffer.put_u8(0xc4)
+				buffer.put_u8(size)
+			elif size <= 0xffff:
+				buffer.put_u8(0xc5)
+				buffer.put_u16(size)
+			else:
+				buffer.put_u8(0xc6)
+				buffer.put_u32(size)
+			buffer.put_data(value)
+		TYPE_ARRAY:
+			var size : int = value.size()
+			if size < 16:
+				buffer.put_u8(0x90 | size)
+			elif size <= 0xffff:
+				buffer.put_u8(0xdc)
+				buffer.put_u16(size)
+			else:
+				buffer.put_u8(0xdd)
+				buffer.put_u32(size)
+			for element in value:
+				_encode_value(buffer, element)
+		TYPE_DICTIONARY:
+			var size : int = value.size()
+			if size < 16:
+				buffer.put_u8(0x80 | size)
+			elif size <= 0xffff:
+				buffer.put_u8(0xde)
+				buffer.put_u16(size)
+			else:
+				buffer.put_u8(0xdf)
+				buffer.put_u32(size)
+			for key in value:
+				_encode_value(buffer, key)
+				_encode_value(buffer, value[key])
+		_:
+			# Other Godot types are sent as their string representation
+			_encode_value(buffer, str(value))
+
+static func _decode_string(buffer : StreamPeerBuffer, size : int) -> String:
+	return buffer.get_data(size)[1].get_string_from_utf8()
+
+static func _decode_array(buffer : StreamPeerBuffer, size : int) -> Array:
+	var result : Array = []
+	for _i in range(size):
+		result.append(_decode_value(buffer))
+	return result
+
+static func _decode_map(buffer : StreamPeerBuffer, size : int) -> Dictionary:
+	var result : Dictionary = {}
+	for _i in range(size):
+		var key = _decode_value(buffer)
+		result[key] = _decode_value(buffer)
+	return result
+
+static func _decode_value(buffer : StreamPeerBuffer):
+	var tag : int = buffer.get_u8()
+	if tag <= 0x7f:
+		return tag
+	if tag >= 0xe0:
+		return tag - 0x100
+	if (tag & 0xf0) == 0x80:
+		return _decode_map(buffer, tag & 0x0f)
+	if (tag & 0xf0) == 0x90:
+		return _decode_array(buffer, tag & 0x0f)
+	if (tag & 0xe0) == 0xa0:
+		return _decode_string(buffer, tag & 0x1f)
+	match tag:
+		0xc0: return null
+		0xc2: return false
+		0xc3: return true
+		0xc4: return buffer.get_data(buffer.get_u8())[1]
+		0xc5: return buffer.get_data(buffer.get_u16())[1]
+		0xc6: return buffer.get_data(buffer.get_u32())[1]
+		0xca: return buffer.get_float()
+		0xcb: return buffer.get_double()
+		0xcc: return buffer.get_u8()
+		0xcd: return buffer.get_u16()
+		0xce: return buffer.get_u32()
+		0xcf: return buffer.get_u64()
+		0xd0: return buffer.get_8()
+		0xd1: return buffer.get_16()
+		0xd2: return buffer.get_32()
+		0xd3: return buffer.get_64()
+		0xd9: return _decode_string(buffer, buffer.get_u8())
+		0xda: return _decode_string(buffer, buffer.get_u16())
+		0xdb: return _decode_string(buffer, buffer.get_u32())
+		0xdc: return _decode_array(buffer, buffer.get_u16())
+		0xdd: return _decode_array(buffer, buffer.get_u32())
+		0xde: return _decode_map(buffer, buffer.get_u16())
+		0xdf: return _decode_map(buffer, buffer.get_u32())
+	prints("SGS: Unsupported msgpack tag:", tag)
+	return null
@@ -3,33 +3,90 @@
  */
 
 #include <cstdint>
-#include <functional>
 #include <string>
 #include <map>
 
 #include "json.hpp"
+#include "processors.hpp"
 
 using nlohmann::json;
 
 namespace config {
 
-bool debug = true;
+bool debug = true;  // Log per-connection events
+unsigned log_rate_limit = 1000;  // Log records per second per thread, excess records are dropped. 0 for no limit.
 uint16_t port = 3000;
+unsigned threads = 1;  // Event loop threads sharing the port. Lobbies are split between them. 0 uses one per core.
 uint64_t max_players = 256;
 uint64_t max_lobbies = 16;
 uint64_t max_players_per_lobby = 16;
 
 uint16_t player_timeout = 12;  // Seconds until player is forcefully disconnected
+unsigned player_id_quarantine = 30;  // Seconds before the id of a disconnected player is given to a new one
 
-std::map<std::string, std::function<json (const json)>> game_processing = {
-	{"increment", [](const json message) {
-		json return_message = message;
-		json data = message.value("data", json::object());
-		int value = data.value("value", 0);
-		data["value"] = value + 1;
-		return_message["data"] = data;
-		return return_message;
-	}}
+// Players get a resume token when they join a lobby. If their connection drops, their slot (and leadership)
+// is held and messages for them are kept, so a reconnecting player sends a resume message instead of joining again.
+unsigned resume_grace = 15;  // Seconds a disconnected player's lobby slot is held. 0 leaves the lobby immediately.
+size_t resume_replay_messages = 256;  // Messages kept for a disconnected player, older ones are dropped
+bool envelope_relay = true;  // Forward data messages without re-serializing them (only type/lobby/game are read)
+
+// What to do when a player's server-side queue exceeds max_queued_messages
+enum class SlowConsumerPolicy {
+	DROP_OLDEST,  // Drop the oldest queued relayed message
+	COALESCE,  // Keep only the newest queued relayed message
+	DISCONNECT  // Close the connection
+};
+unsigned max_backpressure = 64 * 1024;  // Bytes buffered in a player's socket before the server queues messages for them
+size_t max_queued_messages = 256;  // Messages queued per player before slow_consumer_policy applies
+SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::DROP_OLDEST;
+int congestion_check_interval = 100;  // Milliseconds between checks for players congested by broadcasts
+
+// permessage-deflate for clients offering it. Messages are compressed as a whole, per connection or per
+// broadcast; the /metrics endpoint reports sampled compression ratios and the send time of compressed frames.
+enum class Compression {
+	DISABLED,
+	SHARED,  // One compressor per thread, no memory per connection but no context between messages
+	DEDICATED  // One compressor per connection keeping compression_window of context, best for repetitive traffic
+};
+Compression compression = Compression::DISABLED;
+unsigned compression_window = 32;  // Kilobytes of context per connection with DEDICATED, rounded up to 3, 4, 8, ..., 256
+size_t compression_min_size = 128;  // Bytes below which messages are sent uncompressed
+unsigned compression_sample_interval = 64;  // Every n-th compressed message is also deflated alone to measure the ratio. 0 to disable.
+
+// Limits of lobbies of games played in front of large audiences (spectators, live events).
+// Leader updates reach members through one topic publish per thread, member messages still go to the leader.
+// config::max_players must leave room for the audience.
+struct LargeLobby {
+	uint64_t max_players;  // Replaces max_players_per_lobby
+	size_t max_queued_messages;  // Replaces max_queued_messages for every member, keeping slow spectators cheap
+};
+std::map<std::string, LargeLobby> large_lobbies = {
+	// {"bench-large", {5000, 64}},  // Audience benchmark of the README, also raise max_players to 5001 or more
 };
 
+// Game processors rewrite the data messages of their game before they are relayed (see processors.hpp)
+struct IncrementProcessor {
+	static constexpr std::string_view name = "increment";
+
+	static void process(json &message) {
+		json &data = message["data"];
+		if (!data.is_object()) data = json::object();
+		json &value = data["value"];
+		value = value.is_number_integer() ? value.get<int64_t>() + 1 : 1;
+	}
+};
+
+using GameProcessors = ProcessorTable<IncrementProcessor>;  // Every game processor
+unsigned processor_threads = 2;  // Worker threads running offloaded processors. 0 runs them on the event loops.
+
+// Games whose member messages are batched and sent to the leader once per tick, in milliseconds.
+// The leader receives {"type": "batch", "lobby": ..., "data": [message, ...]} instead of single messages.
+std::map<std::string, int> game_batching = {};
+
+// Games whose lobbies keep a versioned mirror of the leader's initialization data (full and patched).
+// Joiners get the last keyframe {"type": "state", "version": ...} followed by the patches since
+// {"type": "state_patch", "version": ...}, and members are sent every update as it arrives.
+// Value is the number of patches kept before the current state becomes the next keyframe.
+std::map<std::string, size_t> state_mirrors = {};
+
 }
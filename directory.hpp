@@ -0,0 +1,114 @@
+// directory.hpp
+// =============
+// Open-addressing hash index of objects keyed by a string they own.
+// The index stores no copy of the key, lookups take a string_view and never allocate.
+
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+
+// KeyOf is a functor returning the key of a stored object as a string_view
+template <typename T, typename KeyOf>
+struct StringIndex {
+	struct Slot {
+		size_t hash = 0;  // Cached hash of key
+		T *value = nullptr;  // Stored object, nullptr if slot is empty
+	};
+
+	std::vector<Slot> slots;  // Linear probing table, size is zero or a power of two
+	size_t count = 0;  // Number of stored objects
+
+	static size_t hash_of(std::string_view key) {
+		return std::hash<std::string_view>{}(key);
+	}
+
+	// Number of stored objects
+	size_t size() const {
+		return this->count;
+	}
+
+	// Find object by key, nullptr if missing
+	T *find(std::string_view key) const {
+		if (this->count == 0) return nullptr;
+		size_t hash = hash_of(key);
+		size_t mask = this->slots.size() - 1;
+		for (size_t i = hash & mask; this->slots[i].value; i = (i + 1) & mask) {
+			const Slot &slot = this->slots[i];
+			if (slot.hash == hash && KeyOf{}(slot.value) == key) {
+				return slot.value;
+			}
+		}
+		return nullptr;
+	}
+
+	// Insert object. Returns false if its key is already present.
+	bool insert(T *value) {
+		if ((this->count + 1) * 4 > this->slots.size() * 3) {
+			this->rehash(this->slots.empty() ? 16 : this->slots.size() * 2);
+		}
+		std::string_view key = KeyOf{}(value);
+		size_t hash = hash_of(key);
+		size_t mask = this->slots.size() - 1;
+		size_t i = hash & mask;
+		for (; this->slots[i].value; i = (i + 1) & mask) {
+			if (this->slots[i].hash == hash && KeyOf{}(this->slots[i].value) == key) {
+				return false;
+			}
+		}
+		this->slots[i] = {hash, value};
+		this->count++;
+		return true;
+	}
+
+	// Remove object by key. Returns false if missing.
+	bool erase(std::string_view key) {
+		if (this->count == 0) return false;
+		size_t hash = hash_of(key);
+		size_t mask = this->slots.size() - 1;
+		size_t i = hash & mask;
+		for (; this->slots[i].value; i = (i + 1) & mask) {
+			if (this->slots[i].hash == hash && KeyOf{}(this->slots[i].value) == key) {
+				break;
+			}
+		}
+		if (!this->slots[i].value) return false;
+
+		// Backward shift deletion keeps probe sequences intact without tombstones
+		size_t hole = i;
+		for (size_t j = (i + 1) & mask; this->slots[j].value; j = (j + 1) & mask) {
+			size_t home = this->slots[j].hash & mask;
+			if (((j - home) & mask) >= ((j - hole) & mask)) {
+				this->slots[hole] = this->slots[j];
+				hole = j;
+			}
+		}
+		this->slots[hole] = Slot();
+		this->count--;
+		return true;
+	}
+
+	// Call f for every stored object
+	template <typename F>
+	void for_each(F &&f) const {
+		for (const Slot &slot : this->slots) {
+			if (slot.value) f(slot.value);
+		}
+	}
+
+	void rehash(size_t capacity) {
+		std::vector<Slot> old_slots(capacity);
+		old_slots.swap(this->slots);
+		size_t mask = capacity - 1;
+		for (const Slot &slot : old_slots) {
+			if (!slot.value) continue;
+			size_t i = slot.hash & mask;
+			while (this->slots[i].value) i = (i + 1) & mask;
+			this->slots[i] = slot;
+		}
+	}
+};
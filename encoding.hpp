@@ -0,0 +1,340 @@
+// encoding.hpp
+// ============
+// Wire encodings negotiated per connection through the WebSocket subprotocol.
+// Json is the default, MessagePack and CBOR are sent as binary frames.
+
+
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "json.hpp"
+
+
+using nlohmann::json;
+
+enum class Encoding : uint8_t {
+	JSON = 0,
+	MSGPACK = 1,
+	CBOR = 2
+};
+constexpr size_t NUM_ENCODINGS = 3;
+
+// Subprotocol names by encoding
+constexpr std::array<std::string_view, NUM_ENCODINGS> ENCODING_PROTOCOLS = {
+	"sgs.json", "sgs.msgpack", "sgs.cbor"
+};
+
+// True if encoding is sent as binary frames
+inline bool is_binary(Encoding encoding) {
+	return (encoding != Encoding::JSON);
+}
+
+// Nlohmann input format of encoding
+inline json::input_format_t input_format(Encoding encoding) {
+	switch (encoding) {
+		case Encoding::MSGPACK: return json::input_format_t::msgpack;
+		case Encoding::CBOR: return json::input_format_t::cbor;
+		default: return json::input_format_t::json;
+	}
+}
+
+// Pick encoding from a Sec-WebSocket-Protocol header (comma separated, in client preference order).
+// selected is set to the chosen sgs.* protocol, or left empty if none was offered: such clients (e.g. ones
+// carrying a token in the header) get json. Returns false if the client offered sgs.* protocols but none
+// of them is supported.
+inline bool negotiate_encoding(std::string_view protocols, Encoding &encoding, std::string_view &selected) {
+	encoding = Encoding::JSON;
+	selected = std::string_view();
+	bool offered = false;  // True if any sgs.* protocol was offered
+
+	while (!protocols.empty()) {
+		size_t end = protocols.find(',');
+		std::string_view protocol = protocols.substr(0, end);
+		protocols = (end == std::string_view::npos) ? std::string_view() : protocols.substr(end + 1);
+
+		while (!protocol.empty() && protocol.front() == ' ') protocol.remove_prefix(1);
+		while (!protocol.empty() && protocol.back() == ' ') protocol.remove_suffix(1);
+		for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+			if (protocol == ENCODING_PROTOCOLS[i]) {
+				encoding = static_cast<Encoding>(i);
+				selected = ENCODING_PROTOCOLS[i];
+				return true;
+			}
+		}
+		offered = offered || (protocol.substr(0, 4) == "sgs.");
+	}
+	return !offered;
+}
+
+// Decode message. Returns a discarded value if the message is malformed.
+inline json decode(std::string_view message, Encoding encoding) {
+	switch (encoding) {
+		case Encoding::MSGPACK: return json::from_msgpack(message.begin(), message.end(), true, false);
+		case Encoding::CBOR: return json::from_cbor(message.begin(), message.end(), true, false);
+		default: return json::parse(message, nullptr, false, true);
+	}
+}
+
+// Json text of value. MessagePack and CBOR strings are not checked for valid UTF-8 when decoded,
+// so invalid sequences are replaced (U+FFFD) instead of throwing.
+inline std::string dump_json(const json &value) {
+	return value.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+// Encode message
+inline std::string encode(const json &message, Encoding encoding) {
+	std::string encoded;
+	switch (encoding) {
+		case Encoding::MSGPACK: json::to_msgpack(message, encoded); break;
+		case Encoding::CBOR: json::to_cbor(message, encoded); break;
+		default: encoded = dump_json(message); break;
+	}
+	return encoded;
+}
+
+// Append length header of a MessagePack or CBOR string/array. Tags are the 8, 16 and 32 bit variants,
+// a zero tag8 means the type has no 8 bit variant.
+inline void append_length(std::string &out, size_t length, uint8_t tag8, uint8_t tag16, uint8_t tag32) {
+	if (length <= 0xff && tag8) {
+		out.push_back(static_cast<char>(tag8));
+		out.push_back(static_cast<char>(length));
+	} else if (length <= 0xffff) {
+		out.push_back(static_cast<char>(tag16));
+		out.push_back(static_cast<char>(length >> 8));
+		out.push_back(static_cast<char>(length));
+	} else {
+		out.push_back(static_cast<char>(tag32));
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			out.push_back(static_cast<char>(length >> shift));
+		}
+	}
+}
+
+// Build {"type": "batch", "lobby": lobby_name, "data": [items...]} around already encoded items.
+// Json items must be comma separated, binary items are simply concatenated.
+inline std::string encode_batch(Encoding encoding, const std::string &lobby_name, std::string_view items, size_t count) {
+	std::string batch;
+	batch.reserve(items.size() + lobby_name.size() + 48);
+	switch (encoding) {
+		case Encoding::MSGPACK:
+			batch.append("\x83\xa4type\xa5" "batch" "\xa5lobby");
+			if (lobby_name.size() < 32) {
+				batch.push_back(static_cast<char>(0xa0 | lobby_name.size()));
+			} else {
+				append_length(batch, lobby_name.size(), 0xd9, 0xda, 0xdb);
+			}
+			batch.append(lobby_name);
+			batch.append("\xa4" "data");
+			if (count < 16) {
+				batch.push_back(static_cast<char>(0x90 | count));
+			} else {
+				append_length(batch, count, 0, 0xdc, 0xdd);
+			}
+			break;
+		case Encoding::CBOR:
+			batch.append("\xa3\x64type\x65" "batch" "\x65lobby");
+			if (lobby_name.size() < 24) {
+				batch.push_back(static_cast<char>(0x60 | lobby_name.size()));
+			} else {
+				append_length(batch, lobby_name.size(), 0x78, 0x79, 0x7a);
+			}
+			batch.append(lobby_name);
+			batch.append("\x64" "data");
+			if (count < 24) {
+				batch.push_back(static_cast<char>(0x80 | count));
+			} else {
+				append_length(batch, count, 0x98, 0x99, 0x9a);
+			}
+			break;
+		default:
+			batch.append("{\"type\":\"batch\",\"lobby\":");
+			batch.append(dump_json(lobby_name));
+			batch.append(",\"data\":[");
+			break;
+	}
+	batch.append(items);
+	if (!is_binary(encoding)) {
+		batch.append("]}");
+	}
+	return batch;
+}
+
+// Append string value in encoding. Json strings are escaped like json::dump does.
+inline void append_string(std::string &out, std::string_view value, Encoding encoding) {
+	switch (encoding) {
+		case Encoding::MSGPACK:
+			if (value.size() < 32) {
+				out.push_back(static_cast<char>(0xa0 | value.size()));
+			} else {
+				append_length(out, value.size(), 0xd9, 0xda, 0xdb);
+			}
+			out.append(value);
+			return;
+		case Encoding::CBOR:
+			if (value.size() < 24) {
+				out.push_back(static_cast<char>(0x60 | value.size()));
+			} else {
+				append_length(out, value.size(), 0x78, 0x79, 0x7a);
+			}
+			out.append(value);
+			return;
+		default:
+			break;
+	}
+	static const char HEX[] = "0123456789abcdef";
+	out.push_back('"');
+	for (char c : value) {
+		switch (c) {
+			case '"': out.append("\\\""); break;
+			case '\\': out.append("\\\\"); break;
+			case '\b': out.append("\\b"); break;
+			case '\f': out.append("\\f"); break;
+			case '\n': out.append("\\n"); break;
+			case '\r': out.append("\\r"); break;
+			case '\t': out.append("\\t"); break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20) {
+					out.append("\\u00");
+					out.push_back(HEX[c >> 4]);
+					out.push_back(HEX[c & 0xf]);
+				} else {
+					out.push_back(c);
+				}
+		}
+	}
+	out.push_back('"');
+}
+
+// Append unsigned integer in encoding, using the smallest representation like json::to_msgpack/to_cbor
+inline void append_unsigned(std::string &out, uint64_t value, Encoding encoding) {
+	int bytes;
+	switch (encoding) {
+		case Encoding::MSGPACK:
+			if (value < 0x80) {
+				out.push_back(static_cast<char>(value));
+				return;
+			}
+			bytes = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffff) ? 4 : 8;
+			out.push_back(static_cast<char>((bytes == 1) ? 0xcc : (bytes == 2) ? 0xcd : (bytes == 4) ? 0xce : 0xcf));
+			break;
+		case Encoding::CBOR:
+			if (value < 24) {
+				out.push_back(static_cast<char>(value));
+				return;
+			}
+			bytes = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffff) ? 4 : 8;
+			out.push_back(static_cast<char>((bytes == 1) ? 0x18 : (bytes == 2) ? 0x19 : (bytes == 4) ? 0x1a : 0x1b));
+			break;
+		default: {
+			char digits[20];
+			auto result = std::to_chars(digits, digits + sizeof(digits), value);
+			out.append(digits, result.ptr - digits);
+			return;
+		}
+	}
+	for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+		out.push_back(static_cast<char>(value >> shift));
+	}
+}
+
+// Fields of a success reply. Optional fields are left out when unset.
+struct SuccessReply {
+	bool is_leader = false;
+	uint64_t player_id = 0;  // Left out if 0
+	std::string_view resume_token;  // Left out if empty
+	bool resumed = false;  // Adds "resumed": true and the number of missed messages
+	uint64_t missed = 0;
+};
+
+// Build {"type": "success", "lobby": lobby_name, "data": {...}} from preformatted pieces, without a json tree.
+// Bytes match encode() of the same message. The result lives in a per-thread buffer reused by the next call.
+inline std::string_view encode_success(Encoding encoding, std::string_view lobby_name, const SuccessReply &reply) {
+	thread_local std::string out;
+	out.clear();
+	size_t fields = 1 + (reply.player_id != 0) + !reply.resume_token.empty() + (reply.resumed ? 2 : 0);
+	bool json_encoding = !is_binary(encoding);
+	auto key = [&](const char *json_key, const char *msgpack_key, const char *cbor_key) {
+		out.append((encoding == Encoding::MSGPACK) ? msgpack_key : (encoding == Encoding::CBOR) ? cbor_key : json_key);
+	};
+	auto boolean = [&](bool value) {
+		switch (encoding) {
+			case Encoding::MSGPACK: out.push_back(static_cast<char>(value ? 0xc3 : 0xc2)); break;
+			case Encoding::CBOR: out.push_back(static_cast<char>(value ? 0xf5 : 0xf4)); break;
+			default: out.append(value ? "true" : "false"); break;
+		}
+	};
+
+	// Keys in the sorted order json objects are encoded in
+	key("{\"data\":{\"is_leader\":", "\x83\xa4" "data", "\xa3\x64" "data");
+	if (!json_encoding) {
+		out.push_back(static_cast<char>(((encoding == Encoding::MSGPACK) ? 0x80 : 0xa0) | fields));
+		key("", "\xa9is_leader", "\x69is_leader");
+	}
+	boolean(reply.is_leader);
+	if (reply.resumed) {
+		key(",\"missed\":", "\xa6missed", "\x66missed");
+		append_unsigned(out, reply.missed, encoding);
+	}
+	if (reply.player_id != 0) {
+		key(",\"player_id\":", "\xa9player_id", "\x69player_id");
+		append_unsigned(out, reply.player_id, encoding);
+	}
+	if (!reply.resume_token.empty()) {
+		key(",\"resume_token\":", "\xacresume_token", "\x6cresume_token");
+		append_string(out, reply.resume_token, encoding);
+	}
+	if (reply.resumed) {
+		key(",\"resumed\":", "\xa7resumed", "\x67resumed");
+		boolean(true);
+	}
+	key("},\"lobby\":", "\xa5lobby", "\x65lobby");
+	append_string(out, lobby_name, encoding);
+	key(",\"type\":\"success\"}", "\xa4type\xa7success", "\x64type\x67success");
+	return out;
+}
+
+// Message pre-encoded in every encoding
+struct EncodedMessage {
+	std::array<std::string, NUM_ENCODINGS> encoded;
+
+	explicit EncodedMessage(const json &message) {
+		for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+			this->encoded[i] = encode(message, static_cast<Encoding>(i));
+		}
+	}
+
+	const std::string &operator[](Encoding encoding) const {
+		return this->encoded[static_cast<size_t>(encoding)];
+	}
+};
+
+// Message converted on demand to other encodings. The original is decoded at most once.
+struct TranscodedMessage {
+	std::string_view message;  // Original message
+	Encoding encoding;  // Encoding of original message
+	json decoded;  // Original message decoded, valid once a conversion happened
+	std::array<std::string, NUM_ENCODINGS> converted;  // Conversions by encoding
+	std::array<bool, NUM_ENCODINGS> is_converted = {};
+
+	TranscodedMessage(std::string_view message, Encoding encoding) : message(message), encoding(encoding) {}
+
+	// Message in target encoding
+	std::string_view operator[](Encoding target) {
+		if (target == this->encoding) return this->message;
+		size_t index = static_cast<size_t>(target);
+		if (!this->is_converted[index]) {
+			if (this->decoded.is_null()) {
+				this->decoded = decode(this->message, this->encoding);
+			}
+			this->converted[index] = encode(this->decoded, target);
+			this->is_converted[index] = true;
+		}
+		return this->converted[index];
+	}
+};
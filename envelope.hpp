@@ -0,0 +1,157 @@
+// envelope.hpp
+// ============
+// Envelope-only scan of incoming messages.
+// Only the top-level routing keys are extracted, no json tree is built.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json.hpp"
+
+#include "encoding.hpp"
+
+
+using nlohmann::json;
+
+// How a relayed message may be delivered while the recipient is congested
+enum class Delivery : uint8_t {
+	ORDERED,  // Every message is delivered in order
+	LATEST  // "latest": a queued message is replaced by a newer one of the same sender and channel
+};
+
+// Routing information of a message
+struct Envelope {
+	std::string type = "error";  // Message type. Defaults to error like the full parse.
+	std::string lobby;  // Lobby name, empty if missing
+	std::string game;  // Game name, empty if missing
+	uint32_t channel = 0;  // Channel id chosen by the sender, 0 if missing
+	Delivery delivery = Delivery::ORDERED;  // Delivery class of channel
+	bool has_to = false;  // True if "to" is present, whether or not it holds valid ids
+	std::vector<uint64_t> to;  // Recipient ids from "to" (an id or a list of ids), empty if missing
+	bool has_comments = false;  // True if the json message holds comments, which must not be relayed verbatim
+};
+
+// SAX consumer which records top-level envelope keys and skips everything else
+struct EnvelopeScanner {
+	enum class Field {
+		NONE,
+		TYPE,
+		LOBBY,
+		GAME,
+		CHANNEL,
+		DELIVERY,
+		TO
+	};
+
+	Envelope &envelope;
+	Field pending = Field::NONE;  // Envelope field for the next top-level value
+	size_t depth = 0;  // Current object/array depth
+	bool in_to = false;  // True inside the top-level "to" array
+
+	explicit EnvelopeScanner(Envelope &envelope) : envelope(envelope) {}
+
+	// Top-level values of unexpected types are ignored
+	bool scalar() {
+		if (this->depth == 0) return false;  // Top level must be an object
+		this->pending = Field::NONE;
+		return true;
+	}
+
+	bool number_unsigned(json::number_unsigned_t value) {
+		if (this->pending == Field::CHANNEL && value <= UINT32_MAX) {
+			this->envelope.channel = static_cast<uint32_t>(value);
+		} else if (this->pending == Field::TO || (this->in_to && this->depth == 2)) {
+			this->envelope.to.push_back(value);
+		}
+		return this->scalar();
+	}
+
+	bool number_integer(json::number_integer_t value) {
+		if (value >= 0) return this->number_unsigned(static_cast<json::number_unsigned_t>(value));
+		return this->scalar();
+	}
+
+	bool null() { return this->scalar(); }
+	bool boolean(bool) { return this->scalar(); }
+	bool number_float(json::number_float_t, const json::string_t &) { return this->scalar(); }
+	bool binary(json::binary_t &) { return this->scalar(); }
+
+	bool string(json::string_t &value) {
+		if (this->depth == 0) return false;
+		switch (this->pending) {
+			case Field::TYPE: this->envelope.type.swap(value); break;
+			case Field::LOBBY: this->envelope.lobby.swap(value); break;
+			case Field::GAME: this->envelope.game.swap(value); break;
+			case Field::DELIVERY: this->envelope.delivery = (value == "latest") ? Delivery::LATEST : Delivery::ORDERED; break;
+			default: break;
+		}
+		this->pending = Field::NONE;
+		return true;
+	}
+
+	bool key(json::string_t &key) {
+		this->pending = Field::NONE;
+		if (this->depth != 1) return true;
+		if (key == "type") this->pending = Field::TYPE;
+		else if (key == "lobby") this->pending = Field::LOBBY;
+		else if (key == "game") this->pending = Field::GAME;
+		else if (key == "channel") this->pending = Field::CHANNEL;
+		else if (key == "delivery") this->pending = Field::DELIVERY;
+		else if (key == "to") {
+			this->pending = Field::TO;
+			this->envelope.has_to = true;
+		}
+		return true;
+	}
+
+	bool start_object(size_t) {
+		this->pending = Field::NONE;
+		this->depth++;
+		return true;
+	}
+
+	bool end_object() {
+		this->depth--;
+		return true;
+	}
+
+	bool start_array(size_t) {
+		if (this->depth == 0) return false;
+		if (this->depth == 1) this->in_to = (this->pending == Field::TO);  // Arrays nested in "to" keep it
+		this->pending = Field::NONE;
+		this->depth++;
+		return true;
+	}
+
+	bool end_array() {
+		this->depth--;
+		if (this->depth == 1) this->in_to = false;
+		return true;
+	}
+
+	bool parse_error(size_t, const std::string &, const nlohmann::detail::exception &) {
+		return false;
+	}
+};
+
+// Scan message for its envelope. Returns false if the message is not a valid object in the given encoding.
+// Json comments are accepted like the full parse does, but flagged since other parsers reject them.
+inline bool scan_envelope(std::string_view message, Encoding encoding, Envelope &envelope) {
+	EnvelopeScanner scanner(envelope);
+	if (json::sax_parse(message.begin(), message.end(), &scanner, input_format(encoding), true, false)) {
+		return true;
+	}
+	if (encoding != Encoding::JSON) {
+		return false;
+	}
+	envelope = Envelope();
+	EnvelopeScanner commented(envelope);
+	envelope.has_comments = json::sax_parse(message.begin(), message.end(), &commented, input_format(encoding), true, true);
+	return envelope.has_comments;
+}
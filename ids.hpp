@@ -0,0 +1,58 @@
+// ids.hpp
+// =======
+// Allocator of small dense player ids. Released ids are quarantined for a while before they are
+// handed out again, so messages still addressed to a disconnected player never reach its successor.
+// The lowest free id is reused first, keeping ids below the peak number of players plus the quarantine.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <utility>
+#include <vector>
+
+
+struct IdAllocator {
+	using Clock = std::chrono::steady_clock;
+
+	std::mutex mutex;
+	std::deque<std::pair<uint64_t, Clock::time_point>> quarantined;  // Released ids with their release time, oldest first
+	std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t>> free_ids;  // Ids past quarantine, lowest on top
+	uint64_t next = 1;  // Lowest id never handed out. 0 is never a valid id.
+	Clock::duration quarantine;
+
+	explicit IdAllocator(Clock::duration quarantine) : quarantine(quarantine) {}
+
+	// Take an id. Callable from any thread.
+	uint64_t acquire() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto now = Clock::now();
+		while (!this->quarantined.empty() && now - this->quarantined.front().second >= this->quarantine) {
+			this->free_ids.push(this->quarantined.front().first);
+			this->quarantined.pop_front();
+		}
+		if (this->free_ids.empty()) {
+			return this->next++;
+		}
+		uint64_t id = this->free_ids.top();
+		this->free_ids.pop();
+		return id;
+	}
+
+	// Give id back. Callable from any thread.
+	void release(uint64_t id) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->quarantined.emplace_back(id, Clock::now());
+	}
+
+	// One past the highest id handed out so far
+	uint64_t bound() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->next;
+	}
+};
@@ -0,0 +1,234 @@
+// logger.hpp
+// ==========
+// Asynchronous logger. Every thread writes fixed size records into its own single-producer
+// ring buffer and a background thread formats and prints them, so logging never blocks an event loop.
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+enum class LogLevel : uint8_t {
+	DEBUG = 0,
+	INFO = 1,
+	WARNING = 2,
+	ERROR = 3
+};
+
+// One log line. Events are string literals and are stored by pointer.
+struct LogRecord {
+	int64_t time_us;  // Microseconds since epoch
+	LogLevel level;
+	const char *event;  // What happened
+	uint64_t player;  // Player id, 0 if none
+	uint16_t port;  // Port, 0 if none
+	uint8_t lobby_length;  // Bytes of lobby used
+	char lobby[48];  // Lobby name as sent by the client, truncated on a UTF-8 character boundary. Empty if none.
+};
+
+// Ring buffer written by one thread and read by the logger thread
+struct LogRing {
+	static constexpr size_t CAPACITY = 4096;  // Power of two
+	std::array<LogRecord, CAPACITY> records;
+	std::atomic<size_t> head = 0;  // Next record to write, only advanced by the producer
+	std::atomic<size_t> tail = 0;  // Next record to read, only advanced by the consumer
+	std::atomic<uint64_t> dropped = 0;  // Records lost to a full ring or the rate limit
+	int64_t window_start_us = 0;  // Start of the current rate limit window
+	unsigned window_count = 0;  // Records written in the current rate limit window
+
+	bool push(const LogRecord &record) {
+		size_t head = this->head.load(std::memory_order_relaxed);
+		if (head - this->tail.load(std::memory_order_acquire) >= CAPACITY) {
+			return false;
+		}
+		this->records[head & (CAPACITY - 1)] = record;
+		this->head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(LogRecord &record) {
+		size_t tail = this->tail.load(std::memory_order_relaxed);
+		if (tail == this->head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		record = this->records[tail & (CAPACITY - 1)];
+		this->tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+struct Logger {
+	static inline LogLevel level = LogLevel::INFO;  // Records below this level are discarded by the caller
+	static inline unsigned rate_limit = 1000;  // Records per second per thread, 0 for no limit
+	static inline std::mutex rings_mutex;  // Guards rings
+	static inline std::vector<std::unique_ptr<LogRing>> rings;  // Rings of all threads that logged
+	static inline std::atomic<bool> running = false;
+	static inline std::thread writer;
+
+	// Ring of calling thread, registered on first use
+	static LogRing &ring() {
+		thread_local LogRing *ring = nullptr;
+		if (!ring) {
+			std::lock_guard<std::mutex> lock(Logger::rings_mutex);
+			Logger::rings.push_back(std::make_unique<LogRing>());
+			ring = Logger::rings.back().get();
+		}
+		return *ring;
+	}
+
+	static int64_t now_us() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// Queue record. Never blocks; records are dropped when the ring is full or the thread exceeds the rate limit.
+	static void log(LogLevel level, const char *event, uint64_t player = 0, std::string_view lobby = {}, uint16_t port = 0) {
+		if (level < Logger::level) return;
+
+		LogRing &ring = Logger::ring();
+		int64_t now = Logger::now_us();
+		if (now - ring.window_start_us >= 1000000) {
+			ring.window_start_us = now;
+			ring.window_count = 0;
+		}
+		if (Logger::rate_limit && ring.window_count >= Logger::rate_limit && level < LogLevel::ERROR) {
+			ring.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		ring.window_count++;
+
+		LogRecord record;
+		record.time_us = now;
+		record.level = level;
+		record.event = event;
+		record.player = player;
+		record.port = port;
+		size_t length = lobby.size();
+		if (length > sizeof(record.lobby)) {
+			length = sizeof(record.lobby);
+			while (length > 0 && (static_cast<unsigned char>(lobby[length]) & 0xc0) == 0x80) {
+				length--;  // Do not cut a multi-byte character in half
+			}
+		}
+		memcpy(record.lobby, lobby.data(), length);
+		record.lobby_length = static_cast<uint8_t>(length);
+		if (!ring.push(record)) {
+			ring.dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Lobby name of record as a quoted value. Quotes, backslashes and control characters are escaped so
+	// client-chosen names cannot break the key=value format or start a line of their own.
+	static void print_lobby(const LogRecord &record) {
+		char escaped[4 * sizeof(record.lobby) + 3];
+		size_t length = 0;
+		escaped[length++] = '"';
+		for (size_t i = 0; i < record.lobby_length; i++) {
+			unsigned char c = static_cast<unsigned char>(record.lobby[i]);
+			if (c == '"' || c == '\\') {
+				escaped[length++] = '\\';
+				escaped[length++] = static_cast<char>(c);
+			} else if (c < 0x20 || c == 0x7f) {
+				length += snprintf(escaped + length, 5, "\\x%02x", c);
+			} else {
+				escaped[length++] = static_cast<char>(c);
+			}
+		}
+		escaped[length++] = '"';
+		fwrite(escaped, 1, length, stdout);
+	}
+
+	static void print(const LogRecord &record) {
+		static const char *LEVELS[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+		time_t seconds = record.time_us / 1000000;
+		struct tm time;
+		gmtime_r(&seconds, &time);
+		char timestamp[32];
+		strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &time);
+
+		printf("%s.%03dZ %s %s", timestamp, (int) (record.time_us / 1000 % 1000), LEVELS[(int) record.level], record.event);
+		if (record.player) printf(" player=%" PRIu64, record.player);
+		if (record.lobby_length) {
+			printf(" lobby=");
+			Logger::print_lobby(record);
+		}
+		if (record.port) printf(" port=%hu", record.port);
+		printf("\n");
+	}
+
+	// Print everything queued so far. Returns number of printed records.
+	static size_t drain() {
+		std::vector<LogRing *> rings;  // Rings are never removed, so they can be read without the lock
+		{
+			std::lock_guard<std::mutex> lock(Logger::rings_mutex);
+			for (auto &ring : Logger::rings) rings.push_back(ring.get());
+		}
+		size_t printed = 0;
+		LogRecord record;
+		for (auto *ring : rings) {
+			while (ring->pop(record)) {
+				Logger::print(record);
+				printed++;
+			}
+			uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+			if (dropped) {
+				printf("Dropped %" PRIu64 " log records\n", dropped);
+			}
+		}
+		if (printed) fflush(stdout);
+		return printed;
+	}
+
+	// Start background writer
+	static void start(LogLevel level, unsigned rate_limit) {
+		Logger::level = level;
+		Logger::rate_limit = rate_limit;
+		Logger::running = true;
+		Logger::writer = std::thread([]() {
+			while (Logger::running) {
+				if (Logger::drain() == 0) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+			}
+			Logger::drain();
+		});
+	}
+
+	// Stop background writer after printing everything queued
+	static void stop() {
+		Logger::running = false;
+		if (Logger::writer.joinable()) {
+			Logger::writer.join();
+		}
+	}
+};
+
+inline void log_debug(const char *event, uint64_t player = 0, std::string_view lobby = {}) {
+	Logger::log(LogLevel::DEBUG, event, player, lobby);
+}
+
+inline void log_info(const char *event, uint64_t player = 0, std::string_view lobby = {}) {
+	Logger::log(LogLevel::INFO, event, player, lobby);
+}
+
+inline void log_warning(const char *event, uint64_t player = 0, std::string_view lobby = {}) {
+	Logger::log(LogLevel::WARNING, event, player, lobby);
+}
+
+inline void log_error(const char *event, uint64_t player = 0, std::string_view lobby = {}) {
+	Logger::log(LogLevel::ERROR, event, player, lobby);
+}
@@ -0,0 +1,192 @@
+// metrics.hpp
+// ===========
+// Per-thread counters and histograms exported in the Prometheus text format.
+// Every metric has a single writer (its shard thread) and is read with relaxed atomics by /metrics.
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+
+// Counter written by one thread. Increments are a plain load/store, no locked instruction.
+struct Counter {
+	std::atomic<uint64_t> value = 0;
+
+	void add(uint64_t n = 1) {
+		this->value.store(this->value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	uint64_t get() const {
+		return this->value.load(std::memory_order_relaxed);
+	}
+};
+
+// Log-linear histogram (HDR style). Each power of two is split into SUB_BUCKETS linear buckets,
+// so recorded values are exact below SUB_BUCKETS and within 12.5% above.
+struct Histogram {
+	static constexpr unsigned SUB_BUCKET_BITS = 3;
+	static constexpr unsigned SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static constexpr unsigned NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+	std::array<Counter, NUM_BUCKETS> buckets;
+	Counter count;
+	Counter sum;
+
+	static unsigned bucket_of(uint64_t value) {
+		if (value < SUB_BUCKETS) return static_cast<unsigned>(value);
+		unsigned shift = (63 - __builtin_clzll(value)) - SUB_BUCKET_BITS;
+		return (shift + 1) * SUB_BUCKETS + static_cast<unsigned>((value >> shift) & (SUB_BUCKETS - 1));
+	}
+
+	// Largest value falling into bucket
+	static uint64_t upper_bound(unsigned bucket) {
+		if (bucket < SUB_BUCKETS) return bucket;
+		unsigned shift = bucket / SUB_BUCKETS - 1;
+		uint64_t lower = static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+		return lower + ((uint64_t(1) << shift) - 1);
+	}
+
+	void record(uint64_t value) {
+		this->buckets[bucket_of(value)].add();
+		this->count.add();
+		this->sum.add(value);
+	}
+
+	// Add counts of other histogram
+	void merge(const Histogram &other) {
+		for (unsigned i = 0; i < NUM_BUCKETS; i++) {
+			this->buckets[i].add(other.buckets[i].get());
+		}
+		this->count.add(other.count.get());
+		this->sum.add(other.sum.get());
+	}
+
+	// Approximate value below which fraction q of recorded values fall
+	uint64_t quantile(double q) const {
+		uint64_t total = this->count.get();
+		if (total == 0) return 0;
+		uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+		uint64_t seen = 0;
+		for (unsigned i = 0; i < NUM_BUCKETS; i++) {
+			seen += this->buckets[i].get();
+			if (seen >= rank) return upper_bound(i);
+		}
+		return upper_bound(NUM_BUCKETS - 1);
+	}
+};
+
+// Traffic of one game on one shard
+struct GameMetrics {
+	Counter messages;  // Relayed messages
+	Counter bytes;  // Relayed bytes (as received)
+};
+
+// Metrics of one shard
+struct ShardMetrics {
+	Counter messages_in;  // Frames received from players
+	Counter bytes_in;
+	Counter messages_out;  // Frames handed to sockets, a topic publish counts once
+	Counter bytes_out;
+	Counter relays;  // Data messages relayed within lobbies
+	Counter joins;  // Lobbies created or joined
+	Counter resumes;  // Lobby slots resumed after a dropped connection
+	Counter errors;  // Malformed frames and error replies
+	Counter dropped;  // Queued or batched messages dropped by the slow consumer policy or replaced by a newer one
+	Counter compressed;  // Frames sent with compression
+	Counter sampled_bytes;  // Size of sampled compressed frames before deflate
+	Counter sampled_compressed_bytes;  // Size of sampled compressed frames after deflate
+	Histogram handler_latency;  // Nanoseconds spent in the message handler
+	Histogram payload_size;  // Bytes per received frame
+	Histogram queue_depth;  // Player queue length when a message had to be queued
+	Histogram cross_shard_delay;  // Nanoseconds tasks waited to run on this shard
+	Histogram compressed_send_time;  // Nanoseconds per send or publish of a compressed frame, deflate included
+
+	static constexpr size_t MAX_GAMES = 256;  // Game names are chosen by clients, further games are counted as OTHER_GAME
+	static constexpr const char *OTHER_GAME = "_other";
+	std::mutex games_mutex;  // Guards insertion into games against concurrent scrapes
+	std::unordered_map<std::string, GameMetrics> games;  // Traffic by game name. Entries are never removed.
+
+	// Metrics of game, created on first use. Callers keep the pointer instead of looking up per message.
+	GameMetrics *game(const std::string &game_name) {
+		std::lock_guard<std::mutex> lock(this->games_mutex);
+		auto search = this->games.find(game_name);
+		if (search != this->games.end()) return &search->second;
+		if (this->games.size() >= MAX_GAMES) return &this->games[OTHER_GAME];
+		return &this->games[game_name];
+	}
+};
+
+// Monotonic nanoseconds for latency measurements
+inline uint64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records the lifetime of the timer into a histogram
+struct ScopedTimer {
+	Histogram &histogram;
+	uint64_t start = now_ns();
+
+	explicit ScopedTimer(Histogram &histogram) : histogram(histogram) {}
+
+	~ScopedTimer() {
+		this->histogram.record(now_ns() - this->start);
+	}
+};
+
+// Write HELP and TYPE lines starting a metric family
+inline void write_header(std::string &out, const char *name, const char *type, const char *help) {
+	out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+	out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+// Write a quoted label value. The text format only knows the escapes \\, \" and \n, other bytes are written raw.
+inline void write_label_value(std::string &out, std::string_view value) {
+	out.push_back('"');
+	for (char c : value) {
+		switch (c) {
+			case '\\': out.append("\\\\"); break;
+			case '"': out.append("\\\""); break;
+			case '\n': out.append("\\n"); break;
+			default: out.push_back(c);
+		}
+	}
+	out.push_back('"');
+}
+
+inline void write_sample(std::string &out, const char *name, const std::string &labels, uint64_t value) {
+	out.append(name).append("{").append(labels).append("} ").append(std::to_string(value)).append("\n");
+}
+
+// Write histogram samples with cumulative buckets at powers of two.
+// Every bucket is written on every scrape, and +Inf and _count come from the same bucket reads, so the
+// series stay consistent while other threads keep recording.
+inline void write_histogram(std::string &out, const std::string &name, const std::string &labels, const Histogram &histogram) {
+	uint64_t cumulative = 0;
+	for (unsigned i = Histogram::SUB_BUCKETS - 1; i < Histogram::NUM_BUCKETS; i += Histogram::SUB_BUCKETS) {
+		for (unsigned j = i + 1 - Histogram::SUB_BUCKETS; j <= i; j++) {
+			cumulative += histogram.buckets[j].get();
+		}
+		out.append(name).append("_bucket{").append(labels).append(",le=\"")
+			.append(std::to_string(Histogram::upper_bound(i))).append("\"} ").append(std::to_string(cumulative)).append("\n");
+	}
+	write_sample(out, (name + "_bucket").c_str(), labels + ",le=\"+Inf\"", cumulative);
+	write_sample(out, (name + "_sum").c_str(), labels, histogram.sum.get());
+	write_sample(out, (name + "_count").c_str(), labels, cumulative);
+}
+
+// Write p50/p99/p999 estimates from the fine buckets as gauge samples
+inline void write_quantiles(std::string &out, const char *name, const std::string &labels, const Histogram &histogram) {
+	static const std::pair<const char *, double> QUANTILES[] = {{"0.5", 0.5}, {"0.99", 0.99}, {"0.999", 0.999}};
+	for (const auto &q : QUANTILES) {
+		write_sample(out, name, labels + ",quantile=\"" + q.first + "\"", histogram.quantile(q.second));
+	}
+}
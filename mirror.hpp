@@ -0,0 +1,125 @@
+// mirror.hpp
+// =========
+// Versioned copy of a lobby's game state kept by the server. Leader snapshots become keyframes and
+// leader patches (RFC 6902) become deltas on top of them. A joiner gets the last keyframe followed by
+// the deltas since, all encoded once and shared by every joiner. Once max_deltas deltas piled up,
+// the current state becomes the next keyframe.
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json.hpp"
+
+#include "encoding.hpp"
+
+
+using nlohmann::json;
+
+struct StateMirror {
+	using Message = std::shared_ptr<const std::string>;
+
+	struct Delta {
+		uint64_t version;  // Version reached by applying patch
+		json patch;
+		std::array<Message, NUM_ENCODINGS> messages;  // Encoded on first join
+	};
+
+	size_t max_deltas = 0;  // Deltas kept before the state becomes the next keyframe
+	uint64_t version = 0;  // Incremented by every snapshot and patch
+	json state = json::object();  // State at version
+	uint64_t keyframe_version = 0;
+	json keyframe = json::object();  // State at keyframe_version
+	std::array<Message, NUM_ENCODINGS> keyframe_messages;  // Encoded on first join
+	std::vector<Delta> deltas;  // Patches from keyframe_version to version, in order
+
+	// Start over with an empty state
+	void reset(size_t max_deltas) {
+		this->max_deltas = max_deltas;
+		this->version = 0;
+		this->state = json::object();
+		this->keyframe_version = 0;
+		this->keyframe = json::object();
+		this->keyframe_messages = {};
+		this->deltas.clear();
+	}
+
+	// Replace state with a snapshot, which becomes the keyframe
+	void set(json snapshot) {
+		this->version++;
+		this->state = snapshot;
+		this->keyframe = std::move(snapshot);
+		this->keyframe_version = this->version;
+		this->keyframe_messages = {};
+		this->deltas.clear();
+	}
+
+	// Apply patch to state. Returns false, leaving state unchanged, if the patch does not apply.
+	bool apply(const json &patch) {
+		json patched;
+		try {
+			patched = this->state.patch(patch);
+		} catch (const std::exception &) {  // Malformed array indices throw std::invalid_argument
+			return false;
+		}
+		this->state = std::move(patched);
+		this->version++;
+		if (this->deltas.size() >= this->max_deltas) {
+			// Compact: joiners get the current state instead of a long chain of patches
+			this->keyframe = this->state;
+			this->keyframe_version = this->version;
+			this->keyframe_messages = {};
+			this->deltas.clear();
+		} else {
+			this->deltas.push_back({this->version, patch, {}});
+		}
+		return true;
+	}
+
+	// {"type": type, "lobby": lobby_name, "version": version, "data": data} in encoding
+	static std::string message(const char *type, std::string_view lobby_name, uint64_t version, const json &data, Encoding encoding) {
+		json message = {
+			{"type", type},
+			{"lobby", lobby_name},
+			{"version", version},
+			{"data", data}
+		};
+		return encode(message, encoding);
+	}
+
+	// True if message is a state or state_patch message in encoding reaching at most version
+	static bool is_covered(std::string_view message, Encoding encoding, uint64_t version) {
+		json decoded = decode(message, encoding);
+		if (!decoded.is_object()) return false;
+		auto type = decoded.find("type");
+		auto reached = decoded.find("version");
+		if (type == decoded.end() || (*type != "state" && *type != "state_patch")) return false;
+		return (reached != decoded.end() && reached->is_number_unsigned() && reached->get<uint64_t>() <= version);
+	}
+
+	// Keyframe followed by every delta, for a joiner using encoding
+	std::vector<Message> join_messages(std::string_view lobby_name, Encoding encoding) {
+		size_t e = static_cast<size_t>(encoding);
+		std::vector<Message> messages;
+		messages.reserve(this->deltas.size() + 1);
+		if (!this->keyframe_messages[e]) {
+			this->keyframe_messages[e] = std::make_shared<const std::string>(
+				message("state", lobby_name, this->keyframe_version, this->keyframe, encoding));
+		}
+		messages.push_back(this->keyframe_messages[e]);
+		for (auto &delta : this->deltas) {
+			if (!delta.messages[e]) {
+				delta.messages[e] = std::make_shared<const std::string>(
+					message("state_patch", lobby_name, delta.version, delta.patch, encoding));
+			}
+			messages.push_back(delta.messages[e]);
+		}
+		return messages;
+	}
+};
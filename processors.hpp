@@ -0,0 +1,91 @@
+// processors.hpp
+// ==============
+// Compile-time table of game processors. A processor is a type with the name of its game,
+//   static constexpr std::string_view name = "...";
+// and one of
+//   static R process(json &message);  // Rewrites the whole message in place
+//   using Data = T; static R process(T &data);  // Works on message["data"] converted with from_json/to_json
+// where R is void, or bool to drop the message by returning false.
+// Expensive processors can set
+//   static constexpr bool offload = true;
+// to run on the worker pool instead of the event loop. They must then be safe to call from any thread.
+// Game names are interned to a processor id once per lobby and messages dispatch through a function table.
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+#include "json.hpp"
+
+
+using nlohmann::json;
+
+using ProcessorId = uint16_t;  // Index of processor in its table plus one
+constexpr ProcessorId NO_PROCESSOR = 0;  // Game without processor
+
+template <typename P, typename = void>
+struct has_data_type : std::false_type {};
+
+template <typename P>
+struct has_data_type<P, std::void_t<typename P::Data>> : std::true_type {};
+
+template <typename P, typename = void>
+struct is_offloaded : std::false_type {};
+
+template <typename P>
+struct is_offloaded<P, std::enable_if_t<P::offload>> : std::true_type {};
+
+template <typename... Processors>
+struct ProcessorTable {
+	static constexpr std::array<std::string_view, sizeof...(Processors)> names = {Processors::name...};
+
+	// Intern game name. Returns NO_PROCESSOR if the game has no processor.
+	static ProcessorId find(std::string_view game_name) {
+		for (size_t i = 0; i < names.size(); i++) {
+			if (names[i] == game_name) return static_cast<ProcessorId>(i + 1);
+		}
+		return NO_PROCESSOR;
+	}
+
+	// True if processor id runs on the worker pool
+	static bool offloaded(ProcessorId id) {
+		static constexpr std::array<bool, sizeof...(Processors)> flags = {is_offloaded<Processors>::value...};
+		return (id != NO_PROCESSOR && flags[id - 1]);
+	}
+
+	// Call processor P on message. Returns false if the message must be dropped.
+	template <typename P>
+	static bool run(json &message) {
+		if constexpr (has_data_type<P>::value) {
+			typename P::Data data;
+			try {
+				data = message.value("data", json::object()).template get<typename P::Data>();
+			} catch (const json::exception &) {
+				return false;  // Data does not fit the processor's type
+			}
+			if constexpr (std::is_same_v<decltype(P::process(data)), bool>) {
+				if (!P::process(data)) return false;
+			} else {
+				P::process(data);
+			}
+			message["data"] = data;
+			return true;
+		} else if constexpr (std::is_same_v<decltype(P::process(message)), bool>) {
+			return P::process(message);
+		} else {
+			P::process(message);
+			return true;
+		}
+	}
+
+	// Run processor id on message in place. Returns false if the message must be dropped.
+	static bool process(ProcessorId id, json &message) {
+		using Function = bool (*)(json &);
+		static constexpr std::array<Function, sizeof...(Processors)> functions = {&run<Processors>...};
+		return functions[id - 1](message);
+	}
+};
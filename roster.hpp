@@ -0,0 +1,126 @@
+// roster.hpp
+// =========
+// Members keyed by id with constant time lookup, insertion and removal.
+// Ids are hashed to lobby-local slots, so memory follows the number of members rather than the largest id.
+// Slots are linked in join order, so the longest present member is always at hand.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+// T must have a uint64_t id
+template <typename T>
+struct Roster {
+	static constexpr uint32_t NONE = UINT32_MAX;  // No slot
+
+	struct Slot {
+		T value;
+		uint32_t prev = NONE;  // Slot of member who joined before, NONE for the oldest
+		uint32_t next = NONE;  // Slot of member who joined after, NONE for the newest
+	};
+
+	std::vector<Slot> slots;  // Member slots, released slots are reused
+	std::vector<uint32_t> free_slots;  // Released slots
+	std::unordered_map<uint64_t, uint32_t> index;  // Slot of every member by id
+	size_t count = 0;  // Number of members
+	uint32_t oldest = NONE;  // Head of join order
+	uint32_t newest = NONE;  // Tail of join order
+
+	// Number of members
+	size_t size() const {
+		return this->count;
+	}
+
+	void reserve(size_t capacity) {
+		this->slots.reserve(capacity);
+		this->index.reserve(capacity);
+	}
+
+	// Remove all members, keeping allocated memory
+	void clear() {
+		this->slots.clear();
+		this->free_slots.clear();
+		this->index.clear();
+		this->count = 0;
+		this->oldest = NONE;
+		this->newest = NONE;
+	}
+
+	// Member by id, nullptr if missing
+	const T *find(uint64_t id) const {
+		auto search = this->index.find(id);
+		if (search == this->index.end()) return nullptr;
+		return &this->slots[search->second].value;
+	}
+
+	T *find(uint64_t id) {
+		auto search = this->index.find(id);
+		if (search == this->index.end()) return nullptr;
+		return &this->slots[search->second].value;
+	}
+
+	// Member who joined first, nullptr if empty
+	const T *first() const {
+		if (this->oldest == NONE) return nullptr;
+		return &this->slots[this->oldest].value;
+	}
+
+	// Add member as the newest. Returns false if its id is already present.
+	bool insert(const T &value) {
+		if (this->index.count(value.id)) return false;
+		uint32_t slot;
+		if (!this->free_slots.empty()) {
+			slot = this->free_slots.back();
+			this->free_slots.pop_back();
+		} else {
+			slot = static_cast<uint32_t>(this->slots.size());
+			this->slots.emplace_back();
+		}
+		this->index[value.id] = slot;
+		this->count++;
+		this->slots[slot] = {value, this->newest, NONE};
+		if (this->newest != NONE) {
+			this->slots[this->newest].next = slot;
+		} else {
+			this->oldest = slot;
+		}
+		this->newest = slot;
+		return true;
+	}
+
+	// Remove member by id. Returns false if missing.
+	bool erase(uint64_t id) {
+		auto search = this->index.find(id);
+		if (search == this->index.end()) return false;
+		uint32_t slot = search->second;
+		this->index.erase(search);
+		this->count--;
+
+		Slot &removed = this->slots[slot];
+		if (removed.prev != NONE) {
+			this->slots[removed.prev].next = removed.next;
+		} else {
+			this->oldest = removed.next;
+		}
+		if (removed.next != NONE) {
+			this->slots[removed.next].prev = removed.prev;
+		} else {
+			this->newest = removed.prev;
+		}
+		this->free_slots.push_back(slot);
+		return true;
+	}
+
+	// Call f for every member in join order
+	template <typename F>
+	void for_each(F &&f) const {
+		for (uint32_t slot = this->oldest; slot != NONE; slot = this->slots[slot].next) {
+			f(this->slots[slot].value);
+		}
+	}
+};
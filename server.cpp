@@ -6,39 +6,232 @@
 
 #pragma GCC diagnostic ignored "-Wunused-value"  // Selectively ignore assert warning
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <cstdio>
+#include <cerrno>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include <sys/random.h>
+#include <zlib.h>
 
 #include "uWebSockets/src/App.h"
 #include "json.hpp"
 
 #include "config.hpp"
+#include "directory.hpp"
+#include "encoding.hpp"
+#include "envelope.hpp"
+#include "ids.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "mirror.hpp"
+#include "roster.hpp"
+#include "slab.hpp"
+#include "worker_pool.hpp"
 
 
 using nlohmann::json;
 
 struct LobbySession;  // Lobby information
 struct PlayerDetails;  // Player/connection information
+struct Shard;  // Event loop thread and the lobbies/players it owns
 
+using LobbyHandle = SlabHandle;  // Lobby slot in its shard's slab, stale once the lobby closes
 
+
+// Latest-wins channel of a relayed message. A queued message is replaced by a newer one of the same channel.
+struct LatestChannel {
+	uint64_t sender = 0;  // Player sending on the channel, 0 if the message is delivered in order
+	uint32_t id = 0;  // Channel id, scoped to the sender
+
+	bool active() const {
+		return (this->sender != 0);
+	}
+
+	bool operator==(const LatestChannel &other) const {
+		return (this->sender == other.sender && this->id == other.id);
+	}
+};
+
+// How a relayed message is routed within its lobby
+struct Route {
+	LatestChannel channel;  // Latest-wins channel, inactive for ordered delivery
+	bool targeted = false;  // True if the leader chose recipients. Nobody gets the message if none of them is valid.
+	std::vector<uint64_t> to;  // Recipients chosen by the leader
+	bool reliable = false;  // True if the slow consumer policy must not drop the message (mirror keyframes and deltas)
+};
+
+// Latest-wins message in a lobby's batch
+struct BatchedLatest {
+	LatestChannel channel;
+	size_t offset;  // Position of message in batch
+	size_t length;
+};
+
+// Message waiting in a congested player's server-side queue
+struct OutboundMessage {
+	std::string data;
+	uWS::OpCode opCode;
+	bool droppable;  // Relayed data may be dropped by the slow consumer policy, control messages may not
+	LatestChannel channel;  // Replaced by newer messages of this channel while queued, if active
+};
+
+using ResumeToken = std::array<uint64_t, 2>;  // Secret of a lobby member, all zero if resumption is disabled
+
+// Player as seen by a lobby. Players are referenced by id since their connection may live on another shard.
+struct LobbyMember {
+	uint64_t id;  // Id of player
+	unsigned shard;  // Index of shard owning the player's connection
+	Encoding encoding;  // Wire encoding of the player's connection
+	ResumeToken token = {};  // Proves a reconnecting player owned this slot
+};
+
+// Random resume token from the kernel's CSPRNG. Tokens must not be predictable from the ones handed out before.
+ResumeToken new_resume_token() {
+	ResumeToken token;
+	auto *bytes = reinterpret_cast<char *>(token.data());
+	size_t filled = 0;
+	while (filled < sizeof(token)) {
+		ssize_t read = getrandom(bytes + filled, sizeof(token) - filled, 0);
+		if (read < 0) {
+			assert(("getrandom only fails when interrupted", errno == EINTR));
+			continue;
+		}
+		filled += static_cast<size_t>(read);
+	}
+	return token;
+}
+
+// Resume token as sent to players, 32 hex digits
+std::array<char, 32> format_resume_token(const ResumeToken &token) {
+	static const char HEX[] = "0123456789abcdef";
+	std::array<char, 32> text;
+	for (size_t i = 0; i < text.size(); i++) {
+		text[i] = HEX[(token[i / 16] >> (60 - 4 * (i % 16))) & 0xf];
+	}
+	return text;
+}
+
+// True if token matches the formatted resume token. Takes the same time wherever the first difference is.
+bool resume_token_matches(const ResumeToken &expected, std::string_view token) {
+	auto text = format_resume_token(expected);
+	if (token.size() != text.size()) return false;
+	unsigned char difference = 0;
+	for (size_t i = 0; i < text.size(); i++) {
+		difference |= static_cast<unsigned char>(text[i] ^ token[i]);
+	}
+	return (difference == 0);
+}
+
+// Lobby member whose connection dropped. Its slot (and leadership) is held until it resumes or the grace period ends.
+struct SuspendedMember {
+	uint64_t deadline;  // now_ns() when the player leaves the lobby
+	std::deque<OutboundMessage> replay;  // Messages for the player since the disconnect, in its encoding
+	size_t missed = 0;  // Messages dropped from replay because it was full
+
+	// Keep message for the player, dropping the oldest beyond config::resume_replay_messages
+	void buffer(std::string_view message, uWS::OpCode opCode, bool droppable, LatestChannel channel) {
+		if (channel.active()) {
+			auto queued = std::find_if(this->replay.rbegin(), this->replay.rend(), [&channel](const OutboundMessage &message) {
+				return message.channel == channel;
+			});
+			if (queued != this->replay.rend()) {
+				queued->data.assign(message);
+				queued->opCode = opCode;
+				return;
+			}
+		}
+		this->replay.push_back({std::string(message), opCode, droppable, channel});
+		while (this->replay.size() > config::resume_replay_messages) {
+			this->replay.pop_front();
+			this->missed++;
+		}
+	}
+};
+
+// Lobbies live in a per-shard slab and are reused: open() starts a lobby in a free slot and close() clears it.
 struct LobbySession {
-	std::string lobby_name;  // Name of lobby. Equivalent to corresponding key in lobbies.
-	std::string game_name;  // Name of lobby game. Must match for player to join lobby. 
-	std::vector<PlayerDetails *> players;  // All players in the game. The first player is the lobby leader.
+	static std::atomic<uint64_t> num_sessions;  // Total number of lobbies across all shards
+	unsigned shard = 0;  // Index of shard owning the lobby. Lobby state is only touched on its thread.
+	LobbyHandle handle;  // Handle of lobby in its shard's slab
+	std::string lobby_name;  // Name of lobby. Key of the lobby in its shard's directory.
+	std::string game_name;  // Name of lobby game. Must match for player to join lobby.
+	ProcessorId game_processor = NO_PROCESSOR;  // Processor of game_name in config::GameProcessors
+	uint64_t max_players = 0;  // Player limit, raised for games in config::large_lobbies
+	size_t max_queued_messages = 0;  // Queue limit of every player in the lobby
+	std::array<std::string, NUM_ENCODINGS> topics;  // Pub/sub topic per encoding every player of the lobby is subscribed to (on their own shard).
+	Roster<LobbyMember> players;  // All players in the game by id, in join order. The oldest player is the lobby leader.
+	std::vector<std::array<uint32_t, NUM_ENCODINGS>> shard_players;  // Number of players per encoding connected to each shard
 	json initialization_data = json::object();  // Data sent to new players to recreate current game state.
-	static std::map<std::string, LobbySession*> sessions;  // All LobbySession::sessions by name
+	std::array<std::shared_ptr<const std::string>, NUM_ENCODINGS> initialization_messages;  // Encoded data message of initialization_data, built on first join
+	bool mirrored = false;  // True if initialization data is kept in mirror instead (config::state_mirrors)
+	StateMirror mirror;  // Versioned initialization data, streamed to joiners as keyframe and deltas
+	size_t game_slot = 0;  // Position in the directory's list of lobbies for game_name
+	GameMetrics *game_metrics = nullptr;  // Traffic counters of game_name on the owning shard
+	bool batching = false;  // True if member messages are sent to the leader once per tick (config::game_batching)
+	std::string batch;  // Member messages waiting for the next tick, encoded for the leader
+	size_t batch_count = 0;  // Number of messages in batch
+	std::vector<BatchedLatest> batch_latest;  // Latest-wins messages in batch, replaced in place by newer ones
+	std::unordered_map<uint64_t, SuspendedMember> suspended;  // Disconnected players within the resume grace period, by id
+
+	// Start lobby in a freshly acquired slot. Buffers kept from previous lobbies are reused.
+	void open(unsigned shard, unsigned num_shards, LobbyHandle handle, const LobbyMember &leader,
+			const std::string &lobby_name, const std::string &game_name, GameMetrics *game_metrics) {
+		this->shard = shard;
+		this->handle = handle;
+		this->lobby_name = lobby_name;
+		this->game_name = game_name;
+		this->game_metrics = game_metrics;
+		this->game_processor = config::GameProcessors::find(game_name);
+		auto large = config::large_lobbies.find(game_name);
+		if (large != config::large_lobbies.end()) {
+			this->max_players = large->second.max_players;
+			this->max_queued_messages = large->second.max_queued_messages;
+		} else {
+			this->max_players = config::max_players_per_lobby;
+			this->max_queued_messages = config::max_queued_messages;
+		}
+		for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+			this->topics[i].assign(ENCODING_PROTOCOLS[i]).append("/").append(lobby_name);
+		}
+		this->players.reserve(std::min(this->max_players, config::max_players_per_lobby));  // Large lobbies grow on demand
+		this->shard_players.assign(num_shards, {});
+		this->initialization_data = json::object();
+		this->initialization_messages = {};
+		this->batching = (config::game_batching.find(game_name) != config::game_batching.end());
+		auto mirror = config::state_mirrors.find(game_name);
+		this->mirrored = (mirror != config::state_mirrors.end());
+		this->mirror.reset(this->mirrored ? mirror->second : 0);
+		this->add_player(leader);
+	}
 
-	LobbySession(PlayerDetails *leader, const std::string &lobby_name, const std::string &game_name)
-		: game_name(game_name), lobby_name(lobby_name), players{leader} {}
+	// Clear lobby before its slot is released
+	void close() {
+		this->players.clear();
+		this->suspended.clear();
+		this->initialization_data = json::object();
+		this->initialization_messages = {};
+		this->mirror.reset(0);
+		this->clear_batch();
+	}
 
 	// Get lobby leader
-	PlayerDetails *get_leader() const {
+	const LobbyMember *get_leader() const {
 		assert(("Players is not empty (lobby should have been deinitialized)", this->players.size() > 0));
-		if (this->players.size() == 0) return nullptr;
-		return this->players[0];
+		return this->players.first();
+	}
+
+	// True if player is leader of lobby
+	bool is_leader(uint64_t id) const {
+		auto *leader = this->players.first();
+		return (leader && leader->id == id);
 	}
 
 	// Number of players
@@ -48,57 +241,629 @@ struct LobbySession {
 
 	// True if lobby is full
 	bool is_full() const {
-		return (this->num_players() >= config::max_players_per_lobby);
+		return (this->num_players() >= this->max_players);
 	}
 
 	// Check for player in lobby
-	bool has_player(PlayerDetails *player) const {
-		auto search = std::find(this->players.begin(), this->players.end(), player);
-		return (search != this->players.end());
+	bool has_player(uint64_t id) const {
+		return (this->players.find(id) != nullptr);
+	}
+
+	// Find player in lobby, nullptr if missing
+	const LobbyMember *find_player(uint64_t id) const {
+		return this->players.find(id);
 	}
 
 	// Add player to lobby
-	void add_player(PlayerDetails *player) {
+	void add_player(const LobbyMember &player) {
 		assert(("Lobby should not be overfilled", this->num_players() + 1 <= config::max_players));
-		this->players.push_back(player);
+		if (this->players.insert(player)) {
+			this->shard_players[player.shard][static_cast<size_t>(player.encoding)]++;
+		}
 	}
 
 	// Remove player from lobby
-	bool remove_player(PlayerDetails *player) {
-		auto search = std::find(this->players.begin(), this->players.end(), player);
-		if (search != this->players.end()) {
-			this->players.erase(search);
-			return true;
+	bool remove_player(uint64_t id) {
+		auto *player = this->players.find(id);
+		if (!player) return false;
+		this->shard_players[player->shard][static_cast<size_t>(player->encoding)]--;
+		this->players.erase(id);
+		this->suspended.erase(id);
+		return true;
+	}
+
+	// Handle create/join request of a player without lobby. Run on the shard owning lobby_name.
+	static void request(const LobbyMember &player, const std::string &lobby_name, const std::string &game_name);
+
+	// Handle request of a player without lobby to take over the slot id with token. Run on the shard owning lobby_name.
+	// A slot whose connection is still open (the drop went unnoticed) is suspended first and the request retried with taken_over set.
+	static void resume(const LobbyMember &player, const std::string &lobby_name, uint64_t id, const std::string &token, bool taken_over = false);
+
+	// Hold the slot of a disconnected player, starting its replay buffer with the messages it had queued.
+	// missed counts messages already lost with the connection. Returns false if the player is not in the lobby.
+	bool suspend(uint64_t id, std::deque<OutboundMessage> &&replay, size_t missed);
+
+	// Account for messages lost by a dropped connection before its slot was suspended.
+	// A member which already resumed is sent the current game state again.
+	void report_lost(uint64_t id, size_t lost);
+
+	// Remove suspended players whose grace period ended before now
+	void expire_suspended(uint64_t now);
+
+	// Send message to member, or keep it for replay while the member is suspended
+	void deliver(const LobbyMember &member, std::string_view message, uWS::OpCode opCode, bool droppable = false, LatestChannel channel = {});
+
+	// Topic of lobby for players using encoding
+	const std::string &topic(Encoding encoding) const {
+		return this->topics[static_cast<size_t>(encoding)];
+	}
+
+	// Relay message of a player to the rest of the lobby (or the leader's chosen recipients),
+	// converting it to each recipient's encoding
+	void relay(uint64_t sender, Encoding encoding, std::string_view message, uWS::OpCode opCode, const Route &route = {});
+
+	// Replace initialization data if sent by the leader
+	void set_initialization_data(uint64_t sender, json data);
+
+	// Apply RFC 6902 patch sent by the leader to initialization data. A failing patch leaves it unchanged.
+	void patch_initialization_data(uint64_t sender, const json &patch);
+
+	// Data message carrying initialization_data. Encoded once per encoding and shared by all joiners until the data changes.
+	std::shared_ptr<const std::string> initialization_message(Encoding encoding) {
+		auto &cached = this->initialization_messages[static_cast<size_t>(encoding)];
+		if (!cached) {
+			json message = {
+				{"type", "data"},
+				{"lobby", this->lobby_name}
+			};
+			message["data"] = std::move(this->initialization_data);  // Moved instead of copied, restored below
+			std::string encoded = encode(message, encoding);  // Does not throw on strings from binary leaders, see dump_json
+			this->initialization_data = std::move(message["data"]);
+			cached = std::make_shared<const std::string>(std::move(encoded));
 		}
-		return false;
+		return cached;
+	}
+
+	// Messages bringing a joiner up to date: the mirror's keyframe and deltas, or the initialization data
+	std::vector<std::shared_ptr<const std::string>> join_messages(Encoding encoding) {
+		if (this->mirrored) {
+			return this->mirror.join_messages(this->lobby_name, encoding);
+		}
+		return {this->initialization_message(encoding)};
+	}
+
+	// Add member message for the leader to the batch
+	void add_to_batch(std::string_view message, bool binary, LatestChannel channel);
+
+	// Send buffered member messages to the leader as one batch
+	void flush_batch();
+
+	// Drop buffered member messages
+	void clear_batch() {
+		this->batch.clear();
+		this->batch_count = 0;
+		this->batch_latest.clear();
+	}
+
+	// Remove player, promoting a new leader or deleting the lobby as needed
+	void leave(uint64_t id);
+};
+std::atomic<uint64_t> LobbySession::num_sessions = 0;
+
+// Lobbies of one game
+struct GameLobbies {
+	std::string game_name;
+	std::vector<LobbySession *> lobbies;
+};
+
+struct LobbyNameKey {
+	std::string_view operator()(const LobbySession *lobby) const { return lobby->lobby_name; }
+};
+
+struct GameNameKey {
+	std::string_view operator()(const GameLobbies *game) const { return game->game_name; }
+};
+
+// Lobbies of a shard, indexed by lobby name and by game name
+struct LobbyDirectory {
+	StringIndex<LobbySession, LobbyNameKey> by_name;
+	StringIndex<GameLobbies, GameNameKey> by_game;
+
+	// Number of lobbies
+	size_t size() const {
+		return this->by_name.size();
+	}
+
+	// Find lobby by name, nullptr if missing
+	LobbySession *find(std::string_view lobby_name) const {
+		return this->by_name.find(lobby_name);
+	}
+
+	// Find lobbies of a game, nullptr if there are none
+	const GameLobbies *find_game(std::string_view game_name) const {
+		return this->by_game.find(game_name);
+	}
+
+	// Add lobby. Its name must not be in use.
+	void add(LobbySession *lobby) {
+		bool inserted = this->by_name.insert(lobby);
+		assert(("Lobby names are unique", inserted));
+
+		auto *game = this->by_game.find(lobby->game_name);
+		if (!game) {
+			game = new GameLobbies{lobby->game_name, {}};
+			this->by_game.insert(game);
+		}
+		lobby->game_slot = game->lobbies.size();
+		game->lobbies.push_back(lobby);
+	}
+
+	// Remove lobby
+	void remove(LobbySession *lobby) {
+		this->by_name.erase(lobby->lobby_name);
+
+		auto *game = this->by_game.find(lobby->game_name);
+		assert(("Lobby is listed under its game", game && game->lobbies[lobby->game_slot] == lobby));
+		auto *moved = game->lobbies.back();
+		game->lobbies[lobby->game_slot] = moved;
+		moved->game_slot = lobby->game_slot;
+		game->lobbies.pop_back();
+		if (game->lobbies.empty()) {
+			this->by_game.erase(game->game_name);
+			delete game;
+		}
+	}
+
+	// Call f for every lobby
+	template <typename F>
+	void for_each(F &&f) const {
+		this->by_name.for_each(std::forward<F>(f));
 	}
 };
-std::map<std::string, LobbySession*> LobbySession::sessions;
 
 struct PlayerDetails {
-	static uint64_t last_id;  // Last id given to a player (increments for each new connection)
-	static uint64_t num_concurrent_players;  // Total number of concurrent players
+	static IdAllocator ids;  // Ids of connected players, reused after config::player_id_quarantine
+	static std::atomic<uint64_t> num_concurrent_players;  // Total number of concurrent players
 	uint64_t id = 0;  // Id of current player
-	LobbySession *lobby;
-	uWS::WebSocket<false, true, PlayerDetails> *socket_connection;
+	Shard *shard = nullptr;  // Shard owning the connection
+	LobbyHandle lobby;  // Lobby handle. Only resolved on the lobby's shard.
+	Shard *lobby_shard = nullptr;  // Shard owning lobby
+	ProcessorId game_processor = NO_PROCESSOR;  // Processor of the lobby's game, applied before relaying
+	size_t max_queued_messages = config::max_queued_messages;  // Queue limit, set by the lobby
+	bool joining = false;  // True while a create/join request is handled by another shard
+	Encoding encoding = Encoding::JSON;  // Wire encoding negotiated at upgrade
+	bool deflate = false;  // True if permessage-deflate was negotiated at upgrade
+	std::string topic;  // Lobby topic the player is subscribed to, empty without lobby
+	bool parked = false;  // True while unsubscribed from topic because the socket is congested
+	bool disconnecting = false;  // True once the slow consumer policy decided to close the connection
+	bool replaced = false;  // True once a resuming connection took over the player's id and lobby slot
+	std::deque<OutboundMessage> outbound;  // Messages held back while the socket is congested
+	uWS::WebSocket<false, true, PlayerDetails> *socket_connection = nullptr;
 
 	// True if player in valid lobby
 	bool in_valid_lobby() {
-		return (lobby != nullptr);
+		return lobby.valid();
 	}
 
-	// True if player is leader of lobby
-	bool is_leader() {
-		if (this->in_valid_lobby()) {
-			if (this->lobby->players[0] == this) {
-				return true;
+	// True if the socket buffers more than the configured backpressure
+	bool is_congested() {
+		return (this->socket_connection->getBufferedAmount() > config::max_backpressure);
+	}
+
+	// Send message, queueing it while the socket is congested
+	void send(std::string_view message, uWS::OpCode opCode, bool droppable = false, LatestChannel channel = {});
+
+	// Send queued messages until the socket is congested again. Called on drain.
+	void flush();
+
+	// Stop receiving topic broadcasts directly, they are queued through send instead
+	void park();
+
+	// Resume receiving topic broadcasts directly
+	void unpark();
+
+	// Apply config::slow_consumer_policy to an overfull queue
+	void enforce_queue_limit();
+};
+IdAllocator PlayerDetails::ids(std::chrono::seconds(config::player_id_quarantine));
+std::atomic<uint64_t> PlayerDetails::num_concurrent_players = 0;
+
+WorkerPool processor_pool;  // Runs offloaded game processors
+
+// Message of an offloaded game after processing
+struct ProcessedMessage {
+	uint64_t sender;  // Id of sending player
+	Encoding encoding;  // Encoding of sender and data
+	uWS::OpCode opCode;
+	Route route;
+	bool relayed;  // False if the processor dropped the message
+	std::string data;
+};
+
+// Messages of one lobby handed to the worker pool by one shard. They are relayed in the order they arrived.
+struct OffloadedMessages {
+	uint64_t next_sequence = 0;  // Sequence number of the next submitted message
+	uint64_t next_relay = 0;  // Sequence number of the next message to relay
+	std::map<uint64_t, ProcessedMessage> done;  // Processed messages waiting for earlier ones
+};
+
+// Player whose connection dropped, until its lobby suspended the slot
+struct ClosedPlayer {
+	Shard *lobby_shard;  // Shard owning lobby
+	LobbyHandle lobby;
+	std::string topic;  // Lobby topic the player was subscribed to
+	size_t lost = 0;  // Messages sent to the player since the connection dropped
+};
+
+struct Shard {
+	static std::vector<Shard *> shards;  // All shards by index
+	static thread_local Shard *current;  // Shard of the calling thread
+	static std::atomic<unsigned> num_ready;  // Number of shards with a running loop
+	unsigned index;  // Index in shards
+	uWS::Loop *loop = nullptr;  // Event loop of shard thread
+	uWS::App *app = nullptr;  // Websocket app of shard thread
+	Slab<LobbySession> lobbies;  // Lobby storage, sized so this shard could hold every lobby
+	LobbyDirectory sessions;  // Lobbies owned by this shard
+	std::vector<PlayerDetails *> players;  // Players connected to this shard indexed by id, nullptr for other ids
+	std::unordered_map<std::string, std::vector<uint64_t>> parked;  // Congested players by the topic they left
+	std::unordered_map<uint64_t, ClosedPlayer> closed;  // Dropped players whose slot is not suspended yet, by id
+	size_t deflate_players = 0;  // Connected players which negotiated permessage-deflate
+	ShardMetrics metrics;  // Written on this shard's thread, read by /metrics on any shard
+	std::map<std::pair<unsigned, uint64_t>, OffloadedMessages> offloaded;  // Messages on the worker pool by lobby (shard index, handle)
+	z_stream sampler = {};  // Raw deflate stream estimating compression ratios, set up in run()
+	std::string sample;  // Output buffer of sampler
+
+	explicit Shard(unsigned index) : index(index), lobbies(config::max_lobbies) {}
+
+	// Shard owning a lobby. Lobbies are assigned by name so every shard agrees without coordination.
+	static Shard *for_lobby(std::string_view lobby_name) {
+		return Shard::shards[std::hash<std::string_view>{}(lobby_name) % Shard::shards.size()];
+	}
+
+	// Queue task on this shard's loop, recording how long it waits
+	void defer(std::function<void()> &&task) {
+		this->loop->defer([this, queued = now_ns(), task = std::move(task)]() {
+			this->metrics.cross_shard_delay.record(now_ns() - queued);
+			task();
+		});
+	}
+
+	// Run task on this shard's thread. Runs immediately when already on it.
+	void post(std::function<void()> &&task) {
+		if (Shard::current == this) {
+			task();
+		} else {
+			this->defer(std::move(task));
+		}
+	}
+
+	// Run task with the lobby of handle on this shard's thread. Dropped if the lobby closed in the meantime.
+	void post_lobby(LobbyHandle handle, std::function<void(LobbySession *)> &&task) {
+		this->post([this, handle, task = std::move(task)]() {
+			auto *lobby = this->lobbies.get(handle);
+			if (lobby) {
+				task(lobby);
+			}
+		});
+	}
+
+	// Find player connected to this shard. Must be called on this shard's thread.
+	PlayerDetails *find_player(uint64_t id) {
+		if (id >= this->players.size()) return nullptr;
+		return this->players[id];
+	}
+
+	// Stop counting messages lost by a dropped player once its lobby suspended it, reporting what was lost
+	void seal(uint64_t id);
+
+	// Send message to a player connected to this shard
+	void send(uint64_t id, std::string_view message, uWS::OpCode opCode, bool droppable = false, LatestChannel channel = {});
+
+	// Publish message to the players of topic on this shard, skipping player exclude.
+	// Parked players get it through their queue.
+	void publish(const std::string &topic, std::string_view message, uWS::OpCode opCode, uint64_t exclude = 0, LatestChannel channel = {}, bool droppable = true);
+
+	// Relay message of a player to the lobby of handle on this shard
+	void relay(LobbyHandle lobby, uint64_t sender, Encoding encoding, std::string_view message, uWS::OpCode opCode, Route route);
+
+	// Process message of player on the worker pool, relaying the result from this shard in arrival order.
+	// Must be called on this shard's thread.
+	void offload(const PlayerDetails *player, std::string_view message, uWS::OpCode opCode, Route route);
+
+	// Relay processed messages of a lobby that are next in order
+	void complete_offload(Shard *lobby_shard, LobbyHandle lobby, uint64_t sequence, ProcessedMessage &&processed);
+
+	// Call task on this shard's loop every interval_ms. Must be called on this shard's thread.
+	void every(int interval_ms, std::function<void()> &&task) {
+		auto *timer = us_create_timer((struct us_loop_t *) this->loop, 0, sizeof(std::function<void()> *));
+		*(std::function<void()> **) us_timer_ext(timer) = new std::function<void()>(std::move(task));
+		us_timer_set(timer, [](struct us_timer_t *t) {
+			(**(std::function<void()> **) us_timer_ext(t))();
+		}, interval_ms, interval_ms);
+	}
+
+	// Park players whose socket became congested through topic broadcasts
+	void check_congestion() {
+		for (auto *player : this->players) {
+			if (player && !player->parked && !player->topic.empty() && player->is_congested()) {
+				player->park();
 			}
 		}
-		return false;
 	}
+
+	// True if message should be sent compressed to receivers which negotiated permessage-deflate (negotiated).
+	// Every config::compression_sample_interval-th compressed message is also deflated on its own to estimate
+	// the compression ratio.
+	bool compress(std::string_view message, bool negotiated);
+
+	// Send message to a player's socket, compressing it if worthwhile
+	void write(uWS::WebSocket<false, true, PlayerDetails> *socket, std::string_view message, uWS::OpCode opCode);
+
+	void run();
 };
-uint64_t PlayerDetails::last_id = 0;
-uint64_t PlayerDetails::num_concurrent_players = 0;
+std::vector<Shard *> Shard::shards;
+thread_local Shard *Shard::current = nullptr;
+std::atomic<unsigned> Shard::num_ready = 0;
+
+void Shard::send(uint64_t id, std::string_view message, uWS::OpCode opCode, bool droppable, LatestChannel channel) {
+	if (Shard::current != this) {
+		this->defer([this, id, message = std::string(message), opCode, droppable, channel]() {
+			this->send(id, message, opCode, droppable, channel);
+		});
+		return;
+	}
+	auto *player = this->find_player(id);
+	if (player) {
+		player->send(message, opCode, droppable, channel);
+	} else {
+		auto closed = this->closed.find(id);
+		if (closed != this->closed.end()) {
+			closed->second.lost++;  // Sent before the lobby knew the connection dropped
+		}
+	}
+}
+
+void Shard::seal(uint64_t id) {
+	auto search = this->closed.find(id);
+	if (search == this->closed.end()) return;
+	ClosedPlayer closed = std::move(search->second);
+	this->closed.erase(search);
+	if (closed.lost > 0) {
+		closed.lobby_shard->post_lobby(closed.lobby, [id, lost = closed.lost](LobbySession *lobby) {
+			lobby->report_lost(id, lost);
+		});
+	}
+}
+
+bool Shard::compress(std::string_view message, bool negotiated) {
+	if (!negotiated || message.size() < config::compression_min_size) {
+		return false;
+	}
+	if (config::compression_sample_interval > 0 && this->metrics.compressed.get() % config::compression_sample_interval == 0) {
+		deflateReset(&this->sampler);
+		this->sample.resize(deflateBound(&this->sampler, message.size()) + 8);
+		this->sampler.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(message.data()));
+		this->sampler.avail_in = static_cast<uInt>(message.size());
+		this->sampler.next_out = reinterpret_cast<Bytef *>(&this->sample[0]);
+		this->sampler.avail_out = static_cast<uInt>(this->sample.size());
+		deflate(&this->sampler, Z_SYNC_FLUSH);
+		size_t compressed = this->sample.size() - this->sampler.avail_out - 4;  // Trailing 00 00 ff ff is not sent
+		this->metrics.sampled_bytes.add(message.size());
+		this->metrics.sampled_compressed_bytes.add(compressed);
+	}
+	this->metrics.compressed.add();
+	return true;
+}
+
+void Shard::write(uWS::WebSocket<false, true, PlayerDetails> *socket, std::string_view message, uWS::OpCode opCode) {
+	this->metrics.messages_out.add();
+	this->metrics.bytes_out.add(message.size());
+	if (this->compress(message, socket->getUserData()->deflate)) {
+		ScopedTimer timer(this->metrics.compressed_send_time);
+		socket->send(message, opCode, true);
+	} else {
+		socket->send(message, opCode);
+	}
+}
+
+void Shard::publish(const std::string &topic, std::string_view message, uWS::OpCode opCode, uint64_t exclude, LatestChannel channel, bool droppable) {
+	if (Shard::current != this) {
+		this->defer([this, topic, message = std::string(message), opCode, exclude, channel, droppable]() {
+			this->publish(topic, message, opCode, exclude, channel, droppable);
+		});
+		return;
+	}
+	this->metrics.messages_out.add();
+	this->metrics.bytes_out.add(message.size());
+	bool compress = this->compress(message, this->deflate_players > 0);  // Counted once if any subscriber may inflate it
+	uint64_t start = compress ? now_ns() : 0;
+	auto *excluded = this->find_player(exclude);
+	if (excluded && !excluded->parked) {
+		excluded->socket_connection->publish(topic, message, opCode, compress);  // Publishing socket is skipped
+	} else {
+		this->app->publish(topic, message, opCode, compress);
+	}
+	if (compress) {
+		this->metrics.compressed_send_time.record(now_ns() - start);
+	}
+
+	for (auto &closed : this->closed) {
+		if (closed.second.topic == topic && closed.first != exclude) {
+			closed.second.lost++;  // Published after the connection dropped
+		}
+	}
+
+	auto search = this->parked.find(topic);
+	if (search != this->parked.end()) {
+		std::vector<uint64_t> parked_players = search->second;  // Sending may unpark players
+		for (auto id : parked_players) {
+			auto *player = this->find_player(id);
+			if (player && id != exclude) {
+				player->send(message, opCode, droppable, channel);
+			}
+		}
+	}
+}
+
+void Shard::relay(LobbyHandle lobby, uint64_t sender, Encoding encoding, std::string_view message, uWS::OpCode opCode, Route route) {
+	if (Shard::current == this) {
+		auto *session = this->lobbies.get(lobby);
+		if (session) {
+			session->relay(sender, encoding, message, opCode, route);
+		}
+	} else {
+		this->post_lobby(lobby, [sender, encoding, message = std::string(message), opCode, route = std::move(route)](LobbySession *session) {
+			session->relay(sender, encoding, message, opCode, route);
+		});
+	}
+}
+
+void Shard::offload(const PlayerDetails *player, std::string_view message, uWS::OpCode opCode, Route route) {
+	Shard *lobby_shard = player->lobby_shard;
+	LobbyHandle lobby = player->lobby;
+	uint64_t sequence = this->offloaded[{lobby_shard->index, (uint64_t(lobby.index) << 32) | lobby.generation}].next_sequence++;
+	processor_pool.submit([this, lobby_shard, lobby, sequence, processor = player->game_processor,
+			processed = ProcessedMessage{player->id, player->encoding, opCode, std::move(route), false, std::string(message)}]() mutable {
+		auto decoded = decode(processed.data, processed.encoding);
+		processed.relayed = config::GameProcessors::process(processor, decoded);
+		if (processed.relayed) {
+			processed.data = encode(decoded, processed.encoding);
+		}
+		this->defer([this, lobby_shard, lobby, sequence, processed = std::move(processed)]() mutable {
+			this->complete_offload(lobby_shard, lobby, sequence, std::move(processed));
+		});
+	});
+}
+
+void Shard::complete_offload(Shard *lobby_shard, LobbyHandle lobby, uint64_t sequence, ProcessedMessage &&processed) {
+	auto key = std::make_pair(lobby_shard->index, (uint64_t(lobby.index) << 32) | lobby.generation);
+	auto &messages = this->offloaded[key];
+	messages.done.emplace(sequence, std::move(processed));
+	auto next = messages.done.begin();
+	while (next != messages.done.end() && next->first == messages.next_relay) {
+		const auto &message = next->second;
+		if (message.relayed) {
+			lobby_shard->relay(lobby, message.sender, message.encoding, message.data, message.opCode, message.route);
+		}
+		messages.next_relay++;
+		next = messages.done.erase(next);
+	}
+	if (messages.next_relay == messages.next_sequence) {
+		this->offloaded.erase(key);
+	}
+}
+
+void PlayerDetails::send(std::string_view message, uWS::OpCode opCode, bool droppable, LatestChannel channel) {
+	if (this->disconnecting) return;
+	if (this->outbound.empty() && !this->is_congested()) {
+		this->shard->write(this->socket_connection, message, opCode);
+		if (this->is_congested()) {
+			this->park();
+		}
+		return;
+	}
+
+	this->park();
+	if (channel.active()) {
+		// Replace the queued message of the channel, keeping its place in the queue
+		auto queued = std::find_if(this->outbound.rbegin(), this->outbound.rend(), [&channel](const OutboundMessage &message) {
+			return message.channel == channel;
+		});
+		if (queued != this->outbound.rend()) {
+			queued->data.assign(message);
+			queued->opCode = opCode;
+			this->shard->metrics.dropped.add();
+			return;
+		}
+	}
+	this->outbound.push_back({std::string(message), opCode, droppable, channel});
+	this->shard->metrics.queue_depth.record(this->outbound.size());
+	if (this->outbound.size() > this->max_queued_messages) {
+		this->enforce_queue_limit();
+	}
+}
+
+void PlayerDetails::flush() {
+	while (!this->outbound.empty() && !this->is_congested()) {
+		auto &message = this->outbound.front();
+		this->shard->write(this->socket_connection, message.data, message.opCode);
+		this->outbound.pop_front();
+	}
+	if (this->outbound.empty() && !this->is_congested()) {
+		this->unpark();
+	}
+}
+
+void PlayerDetails::park() {
+	if (this->parked || this->topic.empty()) return;
+	this->parked = true;
+	this->socket_connection->unsubscribe(this->topic);
+	this->shard->parked[this->topic].push_back(this->id);
+}
+
+void PlayerDetails::unpark() {
+	if (!this->parked) return;
+	this->parked = false;
+	auto search = this->shard->parked.find(this->topic);
+	if (search != this->shard->parked.end()) {
+		auto &ids = search->second;
+		ids.erase(std::remove(ids.begin(), ids.end(), this->id), ids.end());
+		if (ids.empty()) {
+			this->shard->parked.erase(search);
+		}
+	}
+	if (!this->topic.empty() && !this->disconnecting) {
+		this->socket_connection->subscribe(this->topic);
+	}
+}
+
+void PlayerDetails::enforce_queue_limit() {
+	auto droppable = [](const OutboundMessage &message) { return message.droppable; };
+	size_t queued = this->outbound.size();
+
+	switch (config::slow_consumer_policy) {
+		case config::SlowConsumerPolicy::DROP_OLDEST: {
+			// Drop oldest relayed message
+			auto oldest = std::find_if(this->outbound.begin(), this->outbound.end(), droppable);
+			if (oldest != this->outbound.end()) {
+				this->outbound.erase(oldest);
+			}
+			break;
+		}
+		case config::SlowConsumerPolicy::COALESCE: {
+			// Keep only the newest relayed message
+			auto newest = std::find_if(this->outbound.rbegin(), this->outbound.rend(), droppable);
+			if (newest != this->outbound.rend()) {
+				const OutboundMessage *kept = &*newest;
+				std::deque<OutboundMessage> coalesced;
+				for (auto &message : this->outbound) {
+					if (!message.droppable || &message == kept) {
+						coalesced.push_back(std::move(message));
+					}
+				}
+				this->outbound.swap(coalesced);
+			}
+			break;
+		}
+		case config::SlowConsumerPolicy::DISCONNECT:
+			break;
+	}
+	this->shard->metrics.dropped.add(queued - this->outbound.size());
+
+	if (this->outbound.size() > this->max_queued_messages) {
+		// Nothing left to drop (or policy is to disconnect)
+		log_warning("Slow consumer disconnected", this->id);
+		this->disconnecting = true;
+		this->shard->metrics.dropped.add(this->outbound.size());
+		this->outbound.clear();
+		this->shard->loop->defer([shard = this->shard, id = this->id]() {
+			auto *player = shard->find_player(id);
+			if (player) {
+				player->socket_connection->end(1008, "Slow consumer");
+			}
+		});
+	}
+}
 
 
 const json EMPTY_JSON = json::object();
@@ -106,60 +871,652 @@ const json CONNECTED = {
 	{"type", "connected"},
 	{"data", EMPTY_JSON}
 };
-const std::string CONNECTED_MESSAGE = CONNECTED.dump();
+const EncodedMessage CONNECTED_MESSAGE(CONNECTED);
 const json SUCCESS = {
 	{"type", "success"},
 	{"data", EMPTY_JSON}
 };
-const std::string SUCCESS_MESSAGE = SUCCESS.dump();
+const EncodedMessage SUCCESS_MESSAGE(SUCCESS);
 const json ERROR = {
 	{"type", "error"},
 	{"data", EMPTY_JSON}
 };
-const std::string ERROR_MESSAGE = ERROR.dump();
+const EncodedMessage ERROR_MESSAGE(ERROR);
 const json DATA = {
 	{"type", "data"},
 	{"data", EMPTY_JSON}
 };
-const std::string DATA_MESSAGE = DATA.dump();
+const EncodedMessage DATA_MESSAGE(DATA);
 
-int main() {
+// Frame type of messages created by the server
+uWS::OpCode opcode(Encoding encoding) {
+	return is_binary(encoding) ? uWS::OpCode::BINARY : uWS::OpCode::TEXT;
+}
+
+// True if the client closed the connection on purpose. Other closes (1006 when the socket dropped or timed out,
+// server-side ends) may be resumed.
+bool is_clean_close(int code) {
+	return (code == 1000 || code == 1001 || code == 1005);  // Normal, going away, close frame without code
+}
+
+// permessage-deflate setting of config::compression. Compressed frames from clients are always accepted.
+uWS::CompressOptions compress_options() {
+	switch (config::compression) {
+		case config::Compression::DISABLED:
+			return uWS::DISABLED;
+		case config::Compression::SHARED:
+			return uWS::CompressOptions(uWS::SHARED_COMPRESSOR | uWS::SHARED_DECOMPRESSOR);
+		case config::Compression::DEDICATED:
+			break;
+	}
+	static const std::pair<unsigned, uWS::CompressOptions> WINDOWS[] = {
+		{3, uWS::DEDICATED_COMPRESSOR_3KB},
+		{4, uWS::DEDICATED_COMPRESSOR_4KB},
+		{8, uWS::DEDICATED_COMPRESSOR_8KB},
+		{16, uWS::DEDICATED_COMPRESSOR_16KB},
+		{32, uWS::DEDICATED_COMPRESSOR_32KB},
+		{64, uWS::DEDICATED_COMPRESSOR_64KB},
+		{128, uWS::DEDICATED_COMPRESSOR_128KB}
+	};
+	uWS::CompressOptions compressor = uWS::DEDICATED_COMPRESSOR_256KB;
+	for (const auto &window : WINDOWS) {
+		if (config::compression_window <= window.first) {
+			compressor = window.second;
+			break;
+		}
+	}
+	return uWS::CompressOptions(compressor | uWS::SHARED_DECOMPRESSOR);
+}
+
+
+// Lobby a create/join request placed a player in, as seen from the player's shard
+struct JoinedLobby {
+	LobbyHandle handle;  // Invalid if the request failed
+	Shard *shard = nullptr;  // Shard owning lobby
+	ProcessorId game_processor = NO_PROCESSOR;
+	size_t max_queued_messages = 0;
+	std::string topic;  // Topic for the player's encoding
+};
+
+// Finish create/join request on the player's shard
+void complete_request(uint64_t player_id, const JoinedLobby &lobby, const std::string &reply, const std::vector<std::shared_ptr<const std::string>> &data_messages) {
+	auto *player = Shard::current->find_player(player_id);
+	if (!player) {
+		// Disconnected while the lobby shard handled the request
+		if (lobby.handle.valid()) {
+			lobby.shard->post_lobby(lobby.handle, [player_id](LobbySession *lobby) { lobby->leave(player_id); });
+		}
+		return;
+	}
+
+	player->joining = false;
+	if (lobby.handle.valid()) {
+		player->lobby = lobby.handle;
+		player->lobby_shard = lobby.shard;
+		player->game_processor = lobby.game_processor;
+		player->max_queued_messages = lobby.max_queued_messages;
+		player->topic = lobby.topic;
+		if (player->outbound.empty()) {
+			player->socket_connection->subscribe(lobby.topic);
+		} else {
+			player->park();
+		}
+	}
+	player->send(reply, opcode(player->encoding));
+	for (const auto &data_message : data_messages) {
+		player->send(*data_message, opcode(player->encoding));
+	}
+}
+
+void LobbySession::request(const LobbyMember &joining, const std::string &lobby_name, const std::string &game_name) {
+	LobbyMember player = joining;
+	if (config::resume_grace > 0) {
+		player.token = new_resume_token();
+	}
+	auto *shard = Shard::current;
+	auto *player_shard = Shard::shards[player.shard];
+	auto *existing = shard->sessions.find(lobby_name);
+	LobbySession *lobby = nullptr;
+	std::string reply = ERROR_MESSAGE[player.encoding];
+	std::vector<std::shared_ptr<const std::string>> data_messages;
+	SuccessReply success;
+
+	if (!existing) {
+		// Create lobby if doesn't exist and the lobby limit allows it
+		LobbyHandle handle;
+
+		if (LobbySession::num_sessions++ >= config::max_lobbies || !(lobby = shard->lobbies.acquire(handle))) {
+			LobbySession::num_sessions--;
+			log_warning("Lobby limit reached", player.id, lobby_name);
+			shard->metrics.errors.add();
+			player_shard->post([player_id = player.id, reply]() {
+				complete_request(player_id, JoinedLobby(), reply, {});
+			});
+			return;
+		}
+
+		log_info("Creating lobby", player.id, lobby_name);
+
+		lobby->open(shard->index, Shard::shards.size(), handle, player, lobby_name, game_name, shard->metrics.game(game_name));
+		shard->sessions.add(lobby);
+		success.is_leader = true;
+		shard->metrics.joins.add();
+	} else {
+		// Add to lobby if not full and game matches
+		log_info("Joining lobby", player.id, lobby_name);
+
+		if (existing->game_name == game_name && !existing->is_full()) {
+			lobby = existing;
+			lobby->add_player(player);
+			success.is_leader = false;
+			shard->metrics.joins.add();
+
+			// Send initialization data
+			data_messages = lobby->join_messages(player.encoding);
+		}
+	}
+
+	if (lobby) {
+		auto token = format_resume_token(player.token);
+		success.player_id = player.id;
+		if (config::resume_grace > 0) {
+			success.resume_token = std::string_view(token.data(), token.size());
+		}
+		reply.assign(encode_success(player.encoding, lobby_name, success));
+	} else {
+		shard->metrics.errors.add();
+	}
+
+	JoinedLobby joined;
+	if (lobby) {
+		joined = {lobby->handle, shard, lobby->game_processor, lobby->max_queued_messages, lobby->topic(player.encoding)};
+	}
+	player_shard->post([player_id = player.id, joined, reply, data_messages]() {
+		complete_request(player_id, joined, reply, data_messages);
+	});
+}
+
+// Hold the lobby slot of a disconnected player, or free its id if the lobby is gone. Run on the shard the player
+// was connected to, which counts messages lost until the lobby shard suspended the slot.
+void suspend_player(Shard *lobby_shard, LobbyHandle lobby, uint64_t id, const std::string &topic, std::deque<OutboundMessage> &&replay, size_t missed) {
+	auto *player_shard = Shard::current;
+	player_shard->closed[id] = {lobby_shard, lobby, topic, 0};
+	lobby_shard->post([player_shard, lobby_shard, lobby, id, replay = std::move(replay), missed]() mutable {
+		auto *session = lobby_shard->lobbies.get(lobby);
+		if (!session || !session->suspend(id, std::move(replay), missed)) {
+			PlayerDetails::ids.release(id);
+		}
+		// Runs after every message the lobby sent to the old connection
+		player_shard->post([player_shard, id]() { player_shard->seal(id); });
+	});
+}
+
+// Finish resume request on the player's shard. The connection takes over the id of the resumed slot.
+void complete_resume(uint64_t player_id, uint64_t resumed_id, const JoinedLobby &lobby, const std::string &reply, std::deque<OutboundMessage> &&replay) {
+	auto *shard = Shard::current;
+	auto *player = shard->find_player(player_id);
+	if (!player) {
+		// Disconnected again while the lobby shard handled the request
+		if (lobby.handle.valid()) {
+			suspend_player(lobby.shard, lobby.handle, resumed_id, lobby.topic, std::move(replay), 0);
+		}
+		return;
+	}
+
+	if (lobby.handle.valid()) {
+		shard->players[player_id] = nullptr;
+		PlayerDetails::ids.release(player_id);
+		player->id = resumed_id;
+		if (resumed_id >= shard->players.size()) {
+			shard->players.resize(resumed_id + 1, nullptr);
+		}
+		shard->players[resumed_id] = player;
+		shard->metrics.resumes.add();
+	}
+	complete_request(player->id, lobby, reply, {});
+	for (auto &message : replay) {
+		player->send(message.data, message.opCode, message.droppable, message.channel);
+	}
+}
+
+// Close the still-open connection of a slot taken over by a resuming player, then retry the resume request.
+// Run on the shard owning the stale connection. Its queued messages start the slot's replay.
+void take_over(Shard *lobby_shard, LobbyHandle lobby, const LobbyMember &player, const std::string &lobby_name, uint64_t id, const std::string &token) {
+	auto *stale = Shard::current->find_player(id);
+	if (stale && stale->lobby == lobby) {
+		log_info("Closing replaced connection", id, lobby_name);
+		stale->replaced = true;
+		stale->disconnecting = true;
+		stale->unpark();
+		Shard::current->players[id] = nullptr;
+		stale->lobby = LobbyHandle();
+		suspend_player(lobby_shard, lobby, id, stale->topic, std::move(stale->outbound), 0);  // Resynced on take-over anyway
+		stale->socket_connection->close();
+	}
+	// Queued behind the suspension (or the one posted by the connection's own close)
+	lobby_shard->post([player, lobby_name, id, token]() {
+		LobbySession::resume(player, lobby_name, id, token, true);
+	});
+}
+
+void LobbySession::resume(const LobbyMember &player, const std::string &lobby_name, uint64_t id, const std::string &token, bool taken_over) {
+	auto *shard = Shard::current;
+	auto *player_shard = Shard::shards[player.shard];
+	auto *lobby = shard->sessions.find(lobby_name);
+	auto *member = lobby ? lobby->players.find(id) : nullptr;
+	bool valid = member && resume_token_matches(member->token, token);
+	if (valid && !lobby->suspended.count(id) && !taken_over && config::resume_grace > 0) {
+		// Drop not noticed yet, the old connection is likely half-open
+		Shard::shards[member->shard]->post([lobby_shard = shard, handle = lobby->handle, player, lobby_name, id, token]() {
+			take_over(lobby_shard, handle, player, lobby_name, id, token);
+		});
+		return;
+	}
+	if (!valid || !lobby->suspended.count(id)) {
+		log_warning("Resume rejected", player.id, lobby_name);
+		shard->metrics.errors.add();
+		player_shard->post([player_id = player.id, reply = ERROR_MESSAGE[player.encoding]]() {
+			complete_resume(player_id, 0, JoinedLobby(), reply, {});
+		});
+		return;
+	}
+
+	log_info("Resuming player", id, lobby_name);
+
+	// Move the slot to the new connection, which may use another shard and encoding
+	if (lobby->is_leader(id)) {
+		lobby->flush_batch();  // Into the replay, batched items are in the previous encoding
+	}
+	auto suspended = std::move(lobby->suspended[id]);
+	lobby->suspended.erase(id);
+	Encoding previous_encoding = member->encoding;
+	lobby->shard_players[member->shard][static_cast<size_t>(member->encoding)]--;
+	member->shard = player.shard;
+	member->encoding = player.encoding;
+	lobby->shard_players[member->shard][static_cast<size_t>(member->encoding)]++;
+
+	bool is_leader = lobby->is_leader(id);
+	std::deque<OutboundMessage> replay;
+	bool resync = (suspended.missed > 0 || taken_over) && !is_leader;
+	if (resync) {
+		// Replay is incomplete (frames written to a replaced connection may be lost), start over from the current game state
+		for (const auto &data_message : lobby->join_messages(player.encoding)) {
+			replay.push_back({*data_message, opcode(player.encoding), false, {}});
+		}
+	}
+	for (auto &message : suspended.replay) {
+		if (resync && lobby->mirrored && !message.droppable && StateMirror::is_covered(message.data, previous_encoding, lobby->mirror.version)) {
+			continue;  // Already part of the keyframe and deltas sent above
+		}
+		if (previous_encoding != player.encoding) {
+			TranscodedMessage transcoded(message.data, previous_encoding);
+			message.data = std::string(transcoded[player.encoding]);
+			message.opCode = opcode(player.encoding);
+		}
+		replay.push_back(std::move(message));
+	}
+
+	SuccessReply success;
+	success.is_leader = is_leader;
+	success.player_id = id;
+	success.resume_token = token;
+	success.resumed = true;
+	success.missed = suspended.missed;
+	JoinedLobby joined = {lobby->handle, shard, lobby->game_processor, lobby->max_queued_messages, lobby->topic(player.encoding)};
+	player_shard->post([player_id = player.id, id, joined, reply = std::string(encode_success(player.encoding, lobby_name, success)), replay = std::move(replay)]() mutable {
+		complete_resume(player_id, id, joined, reply, std::move(replay));
+	});
+}
+
+void LobbySession::relay(uint64_t sender, Encoding encoding, std::string_view message, uWS::OpCode opCode, const Route &route) {
+	auto *leader = this->get_leader();
+	if (!leader) return;
+	Shard::shards[this->shard]->metrics.relays.add();
+	this->game_metrics->messages.add();
+	this->game_metrics->bytes.add(message.size());
+
+	// Original frame type is kept when no conversion is needed
+	TranscodedMessage transcoded(message, encoding);
+	auto frame_type = [&](Encoding target) {
+		return (target == encoding) ? opCode : opcode(target);
+	};
+
+	const LatestChannel &channel = route.channel;
+	bool droppable = !route.reliable;
+	if (leader->id == sender && route.targeted) {
+		// Send only to the recipients chosen by the leader
+		for (uint64_t id : route.to) {
+			auto *recipient = this->find_player(id);
+			if (recipient && id != sender) {
+				this->deliver(*recipient, transcoded[recipient->encoding], frame_type(recipient->encoding), droppable, channel);
+			}
+		}
+	} else if (leader->id == sender) {
+		// Send to everyone. Converted once per encoding, framed once per shard and shared by all subscribers there.
+		for (unsigned i = 0; i < this->shard_players.size(); i++) {
+			for (size_t e = 0; e < NUM_ENCODINGS; e++) {
+				if (this->shard_players[i][e] > 0) {
+					auto target = static_cast<Encoding>(e);
+					Shard::shards[i]->publish(this->topic(target), transcoded[target], frame_type(target), (i == leader->shard) ? sender : 0, channel, droppable);
+				}
+			}
+		}
+		for (auto &suspended : this->suspended) {
+			auto *member = this->find_player(suspended.first);
+			if (member->id != sender) {
+				suspended.second.buffer(transcoded[member->encoding], frame_type(member->encoding), droppable, channel);
+			}
+		}
+	} else if (this->batching) {
+		// Buffer for the leader until the next tick
+		this->add_to_batch(transcoded[leader->encoding], is_binary(leader->encoding), channel);
+	} else {
+		// Send to leader
+		this->deliver(*leader, transcoded[leader->encoding], frame_type(leader->encoding), droppable, channel);
+	}
+}
+
+void LobbySession::add_to_batch(std::string_view message, bool binary, LatestChannel channel) {
+	if (channel.active()) {
+		auto batched = std::find_if(this->batch_latest.begin(), this->batch_latest.end(), [&channel](const BatchedLatest &latest) {
+			return latest.channel == channel;
+		});
+		if (batched != this->batch_latest.end()) {
+			// Replace the older message of the channel, moving the messages after it
+			size_t offset = batched->offset;
+			ptrdiff_t shift = static_cast<ptrdiff_t>(message.size()) - static_cast<ptrdiff_t>(batched->length);
+			this->batch.replace(offset, batched->length, message);
+			batched->length = message.size();
+			for (auto &latest : this->batch_latest) {
+				if (latest.offset > offset) latest.offset += shift;
+			}
+			Shard::shards[this->shard]->metrics.dropped.add();
+			return;
+		}
+	}
+
+	if (this->batch_count > 0 && !binary) {
+		this->batch.push_back(',');
+	}
+	if (channel.active()) {
+		this->batch_latest.push_back({channel, this->batch.size(), message.size()});
+	}
+	this->batch.append(message);
+	this->batch_count++;
+}
+
+void LobbySession::flush_batch() {
+	if (this->batch_count == 0) return;
+	auto *leader = this->get_leader();
+	std::string message = encode_batch(leader->encoding, this->lobby_name, this->batch, this->batch_count);
+	this->deliver(*leader, message, opcode(leader->encoding), true);
+	this->clear_batch();
+}
+
+void LobbySession::set_initialization_data(uint64_t sender, json data) {
+	if (!this->is_leader(sender)) return;
+	if (this->mirrored) {
+		// New keyframe, also sent to the current members. Encoded like the leader's messages so binary values survive.
+		Encoding encoding = this->get_leader()->encoding;
+		this->mirror.set(std::move(data));
+		auto keyframe = this->mirror.join_messages(this->lobby_name, encoding).front();
+		Route route;
+		route.reliable = true;  // A member missing it would diverge from the mirror
+		this->relay(sender, encoding, *keyframe, opcode(encoding), route);
+		return;
+	}
+	this->initialization_data = std::move(data);
+	this->initialization_messages = {};
+}
+
+void LobbySession::patch_initialization_data(uint64_t sender, const json &patch) {
+	if (!this->is_leader(sender)) return;
+	bool applied = true;
+	if (this->mirrored) {
+		applied = this->mirror.apply(patch);
+	} else {
+		try {
+			this->initialization_data = this->initialization_data.patch(patch);
+		} catch (const std::exception &) {  // Not only json::exception, malformed array indices throw std::invalid_argument
+			applied = false;
+		}
+	}
+	if (!applied) {
+		log_warning("Initialization patch rejected", sender, this->lobby_name);
+		Shard::shards[this->shard]->metrics.errors.add();
+		auto *leader = this->get_leader();
+		this->deliver(*leader, ERROR_MESSAGE[leader->encoding], opcode(leader->encoding));
+		return;
+	}
+
+	if (this->mirrored) {
+		// Delta, also sent to the current members in the leader's encoding
+		Encoding encoding = this->get_leader()->encoding;
+		auto delta = StateMirror::message("state_patch", this->lobby_name, this->mirror.version, patch, encoding);
+		Route route;
+		route.reliable = true;  // A member missing it would apply later deltas to a diverged state
+		this->relay(sender, encoding, delta, opcode(encoding), route);
+	} else {
+		this->initialization_messages = {};  // Encoded again by the next joiner
+	}
+}
+
+void LobbySession::leave(uint64_t id) {
+	bool was_leader = this->is_leader(id);
+	this->remove_player(id);
+	if (this->num_players() == 0) {
+		auto *shard = Shard::shards[this->shard];
+		shard->sessions.remove(this);
+		LobbySession::num_sessions--;
+		log_info("Deleting lobby", 0, this->lobby_name);
+		this->close();
+		shard->lobbies.release(this->handle);
+	} else if (was_leader) {
+		// Messages batched for the old leader are dropped
+		this->clear_batch();
+
+		SuccessReply promotion;
+		promotion.is_leader = true;
+		auto *leader = this->get_leader();
+		this->deliver(*leader, encode_success(leader->encoding, this->lobby_name, promotion), opcode(leader->encoding));
+	}
+}
+
+bool LobbySession::suspend(uint64_t id, std::deque<OutboundMessage> &&replay, size_t missed) {
+	if (!this->has_player(id)) return false;
+	log_info("Suspending player", id, this->lobby_name);
+	auto &suspended = this->suspended[id];
+	suspended.deadline = now_ns() + config::resume_grace * 1000000000ull;
+	suspended.missed += missed;
+	for (auto &message : replay) {
+		suspended.buffer(message.data, message.opCode, message.droppable, message.channel);
+	}
+	return true;
+}
+
+void LobbySession::report_lost(uint64_t id, size_t lost) {
+	auto suspended = this->suspended.find(id);
+	if (suspended != this->suspended.end()) {
+		suspended->second.missed += lost;
+		return;
+	}
+	auto *member = this->find_player(id);
+	if (member && !this->is_leader(id)) {
+		// Resumed before the losses were known
+		for (const auto &data_message : this->join_messages(member->encoding)) {
+			this->deliver(*member, *data_message, opcode(member->encoding));
+		}
+	}
+}
+
+void LobbySession::expire_suspended(uint64_t now) {
+	std::vector<uint64_t> expired;
+	for (const auto &suspended : this->suspended) {
+		if (now >= suspended.second.deadline) {
+			expired.push_back(suspended.first);
+		}
+	}
+	for (uint64_t id : expired) {
+		log_info("Resume grace period ended", id, this->lobby_name);
+		this->leave(id);  // Closes the lobby when the last player is gone
+		PlayerDetails::ids.release(id);
+	}
+}
+
+void LobbySession::deliver(const LobbyMember &member, std::string_view message, uWS::OpCode opCode, bool droppable, LatestChannel channel) {
+	auto suspended = this->suspended.find(member.id);
+	if (suspended != this->suspended.end()) {
+		suspended->second.buffer(message, opCode, droppable, channel);
+	} else {
+		Shard::shards[member.shard]->send(member.id, message, opCode, droppable, channel);
+	}
+}
+
+
+// Run event loop of shard. Each shard listens on the configured port (SO_REUSEPORT) and
+// owns the connections the kernel hands it plus the lobbies whose names hash to it.
+void Shard::run() {
+	Shard::current = this;
+	this->loop = uWS::Loop::get();
+	this->every(config::congestion_check_interval, [this]() { this->check_congestion(); });
+	if (config::compression != config::Compression::DISABLED) {
+		deflateInit2(&this->sampler, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	}
+	if (config::resume_grace > 0) {
+		this->every(1000, [this]() {
+			std::vector<LobbySession *> suspending;  // Collected first, expiring may close lobbies
+			this->sessions.for_each([&suspending](LobbySession *lobby) {
+				if (!lobby->suspended.empty()) suspending.push_back(lobby);
+			});
+			uint64_t now = now_ns();
+			for (auto *lobby : suspending) {
+				lobby->expire_suspended(now);
+			}
+		});
+	}
+	for (const auto &batching : config::game_batching) {
+		// Flush member messages of every lobby of the game once per tick
+		this->every(batching.second, [this, game_name = batching.first]() {
+			auto *game = this->sessions.find_game(game_name);
+			if (game) {
+				for (auto *lobby : game->lobbies) {
+					lobby->flush_batch();
+				}
+			}
+		});
+	}
 	uWS::App app = uWS::App();  // Websocket app
+	this->app = &app;
+	Shard *shard = this;
 
 	// Set up websocket endpoint for players
 	app.ws<PlayerDetails>("/game_server", {
 		// General settings
+		.compression = compress_options(),
 		.idleTimeout = config::player_timeout,
-			
+		.maxBackpressure = 4 * config::max_backpressure,  // Hard limit, players are queued by the server well before it
+		.closeOnBackpressureLimit = true,
+
+		// Connection requested - negotiate wire encoding from the offered subprotocols
+		.upgrade = [](auto *res, auto *req, auto *context) {
+			PlayerDetails player_info;
+			std::string_view protocol;  // Not sent back unless an sgs.* protocol was chosen
+			if (!negotiate_encoding(req->getHeader("sec-websocket-protocol"), player_info.encoding, protocol)) {
+				res->writeStatus("400 Bad Request")->end("Unsupported subprotocol");
+				return;
+			}
+			// uWS accepts permessage-deflate whenever it is offered and compression is enabled
+			player_info.deflate = config::compression != config::Compression::DISABLED
+				&& req->getHeader("sec-websocket-extensions").find("permessage-deflate") != std::string_view::npos;
+			res->template upgrade<PlayerDetails>(std::move(player_info),
+				req->getHeader("sec-websocket-key"),
+				protocol,
+				req->getHeader("sec-websocket-extensions"),
+				context);
+		},
+
 		// Connection started - initialization
 		.open = [=](auto *ws) {
 			auto *player_info = reinterpret_cast<PlayerDetails *>(ws->getUserData());
 
-			if (PlayerDetails::num_concurrent_players >= config::max_players) {
+			if (PlayerDetails::num_concurrent_players++ >= config::max_players) {
+				PlayerDetails::num_concurrent_players--;
 				ws->close();
 				return;
 			}
-			
-			player_info->id = ++PlayerDetails::last_id;
+
+			player_info->id = PlayerDetails::ids.acquire();
+			player_info->shard = shard;
 			player_info->socket_connection = ws;
+			if (player_info->id >= shard->players.size()) {
+				shard->players.resize(player_info->id + 1, nullptr);
+			}
+			shard->players[player_info->id] = player_info;
+			if (player_info->deflate) shard->deflate_players++;
 
-			printf("--Joined: [%llx]\n", player_info->id);
-			PlayerDetails::num_concurrent_players++;
+			log_debug("Joined", player_info->id);
 
-			ws->send(CONNECTED_MESSAGE);
+			player_info->send(CONNECTED_MESSAGE[player_info->encoding], opcode(player_info->encoding));
 		},
-		
+
 		// Generic message received
 		.message = [](auto *ws, std::string_view _message, uWS::OpCode opCode) {
 			auto *current_player = reinterpret_cast<PlayerDetails *>(ws->getUserData());
+			auto &metrics = current_player->shard->metrics;
+			ScopedTimer timer(metrics.handler_latency);
+			metrics.messages_in.add();
+			metrics.bytes_in.add(_message.size());
+			metrics.payload_size.record(_message.size());
+
+			Envelope envelope;
+			if (!scan_envelope(_message, current_player->encoding, envelope)) {
+				metrics.errors.add();
+				return;  // Not an object in the negotiated encoding
+			}
+			const std::string &lobby_name = envelope.lobby;
+			const std::string &game_name = envelope.game;
+			const std::string &message_type = envelope.type;
+
+			if (current_player->joining) {
+				return;  // Lobby request still in flight
+			}
+
+			if (message_type == "initialization_data" && current_player->in_valid_lobby()) {
+				auto message = decode(_message, current_player->encoding);
+				current_player->lobby_shard->post_lobby(current_player->lobby, [id = current_player->id, data = message.value("data", EMPTY_JSON)](LobbySession *lobby) mutable {
+					lobby->set_initialization_data(id, std::move(data));
+				});
+				return;
+			}
 
-			auto message = json::parse(_message, nullptr, false, true);
-			std::string lobby_name = message.value("lobby", "");
-			std::string game_name = message.value("game", "");
-			std::string message_type = message.value("type", "error");
+			if (message_type == "initialization_patch" && current_player->in_valid_lobby()) {
+				auto message = decode(_message, current_player->encoding);
+				current_player->lobby_shard->post_lobby(current_player->lobby, [id = current_player->id, patch = message.value("data", json::array())](LobbySession *lobby) {
+					lobby->patch_initialization_data(id, patch);
+				});
+				return;
+			}
 
-			if (message_type == "initialization_data" && current_player->is_leader() && current_player->in_valid_lobby()) {
-				current_player->lobby->initialization_data = message.value("data", EMPTY_JSON);
+			if (message_type == "resume" && !current_player->in_valid_lobby()) {
+				// Take over the lobby slot of a dropped connection
+				auto data = decode(_message, current_player->encoding).value("data", EMPTY_JSON);
+				json id, token;
+				if (data.is_object()) {
+					id = data.value("player_id", EMPTY_JSON);
+					token = data.value("token", EMPTY_JSON);
+				}
+				// Binary clients may encode the id as a signed integer
+				bool valid_id = id.is_number_unsigned() || (id.is_number_integer() && id.get<int64_t>() >= 0);
+				if (lobby_name == "" || !valid_id || !token.is_string()) {
+					metrics.errors.add();
+					current_player->send(ERROR_MESSAGE[current_player->encoding], opcode(current_player->encoding));
+					return;
+				}
+				current_player->joining = true;
+				Shard::for_lobby(lobby_name)->post([player = LobbyMember{current_player->id, current_player->shard->index, current_player->encoding},
+						lobby_name, id = id.get<uint64_t>(), token = token.get<std::string>()]() {
+					LobbySession::resume(player, lobby_name, id, token);
+				});
 				return;
 			}
 
@@ -167,136 +1524,268 @@ int main() {
 				return;  // Ignore for now
 			}
 
-			// Process packets for certain games
-			if (config::game_processing.find(game_name) != config::game_processing.end()) {
-				message = config::game_processing[game_name](message);
-			}
-			
 			if (current_player->in_valid_lobby()) {
-				auto dumped_message = message.dump();
-				
-				if (current_player->is_leader()) {
-					// Send to everyone
-					for (auto *player : current_player->lobby->players) {
-						if (player != current_player) {
-							player->socket_connection->send(dumped_message);
+				Route route;
+				if (envelope.delivery == Delivery::LATEST) {
+					route.channel = {current_player->id, envelope.channel};
+				}
+				route.targeted = envelope.has_to;
+				route.to = std::move(envelope.to);
+				std::sort(route.to.begin(), route.to.end());
+				route.to.erase(std::unique(route.to.begin(), route.to.end()), route.to.end());  // Each recipient gets one copy
+
+				if (processor_pool.size() > 0 && config::GameProcessors::offloaded(current_player->game_processor)) {
+					current_player->shard->offload(current_player, _message, opCode, std::move(route));
+					return;
+				}
+
+				// Forward original bytes unless the message must be rebuilt. Rebuilding strips json comments.
+				std::string_view dumped_message = _message;
+				std::string processed_message;
+				if (current_player->game_processor != NO_PROCESSOR || !config::envelope_relay || envelope.has_comments) {
+					auto message = decode(_message, current_player->encoding);
+					if (current_player->game_processor != NO_PROCESSOR) {
+						// Process packets for certain games, in place
+						if (!config::GameProcessors::process(current_player->game_processor, message)) {
+							return;  // Rejected by processor
 						}
 					}
-				} else {
-					// Send to leader
-					auto *leader = current_player->lobby->get_leader();
-					if (leader) {
-						leader->socket_connection->send(dumped_message);
-					}
+					processed_message = encode(message, current_player->encoding);
+					dumped_message = processed_message;
 				}
+
+				current_player->lobby_shard->relay(current_player->lobby, current_player->id, current_player->encoding, dumped_message, opCode, std::move(route));
+			} else if (lobby_name == "") {
+				// Invalid lobby
+				metrics.errors.add();
+				current_player->send(ERROR_MESSAGE[current_player->encoding], opcode(current_player->encoding));
 			} else {
-				// Modify lobby
-				auto search = LobbySession::sessions.find(lobby_name);
-
-				if (lobby_name == "") {
-					// Invalid lobby
-					ws->send(ERROR_MESSAGE);
-				} else if (search == LobbySession::sessions.end()) {
-					// Create lobby if doesn't exist
-					json creation_success = SUCCESS;
-					
-					printf("--Creating lobby: %s [%llx]\n", lobby_name.c_str(), current_player->id);
-					
-					LobbySession *new_lobby = new LobbySession(current_player, lobby_name, game_name);
-					LobbySession::sessions[lobby_name] = new_lobby;
-					current_player->lobby = new_lobby;
-					creation_success["data"]["is_leader"] = true;
-					creation_success["data"]["player_id"] = current_player->id;
-					creation_success["lobby"] = lobby_name;
-					ws->send(creation_success.dump());
-				} else {
-					// Add to lobby if not full and game matches
-					auto *lobby = search->second;
-					json joining_success = SUCCESS;
-
-					printf("--Joining lobby: %s [%llx]\n", lobby_name.c_str(), current_player->id);
-
-					if (lobby->game_name != game_name) {
-						ws->send(ERROR_MESSAGE);
-					} else if (lobby->is_full()) {
-						ws->send(ERROR_MESSAGE);
-					} else {
-						lobby->add_player(current_player);
-						current_player->lobby = lobby;
-						joining_success["data"]["is_leader"] = false;
-						joining_success["data"]["player_id"] = current_player->id;
-						joining_success["lobby"] = lobby_name;
-						ws->send(joining_success.dump());
-
-						// Send initialization data
-						auto data_message = DATA;
-						data_message["data"] = lobby->initialization_data;
-						data_message["lobby"] = lobby_name;
-						ws->send(data_message.dump());
-					}
-				}
+				// Create or join lobby on the shard owning it
+				current_player->joining = true;
+				Shard::for_lobby(lobby_name)->post([player = LobbyMember{current_player->id, current_player->shard->index, current_player->encoding}, lobby_name, game_name]() {
+					LobbySession::request(player, lobby_name, game_name);
+				});
 			}
 		},
-		
+
+		// Socket buffer drained - resume queued sends
+		.drain = [](auto *ws) {
+			auto *current_player = reinterpret_cast<PlayerDetails *>(ws->getUserData());
+			if (current_player->id != 0) {
+				current_player->flush();
+			}
+		},
+
 		// Connection ended - destruction
-		.close = [](auto *ws, int code, std::string_view message) {
+		.close = [=](auto *ws, int code, std::string_view message) {
 			auto *current_player = reinterpret_cast<PlayerDetails *>(ws->getUserData());
-			
-			auto *lobby = current_player->lobby;
-			bool was_leader = current_player->is_leader();
-			lobby->remove_player(current_player);
-			if (lobby->num_players() == 0) {
-				LobbySession::sessions.erase(lobby->lobby_name);
-				printf("--Deleting lobby: %s\n", lobby->lobby_name.c_str());
-				delete lobby;
-			} else if (was_leader) {
-				auto new_leader_message = SUCCESS;
-				new_leader_message["data"]["is_leader"] = true;
-				new_leader_message["lobby"] = lobby->lobby_name;
-				lobby->players[0]->socket_connection->send(new_leader_message.dump());
+			if (current_player->id == 0) {
+				return;  // Rejected in open
+			}
+
+			current_player->disconnecting = true;
+			current_player->unpark();
+			if (shard->find_player(current_player->id) == current_player) {
+				shard->players[current_player->id] = nullptr;
+			}
+			if (current_player->deflate) shard->deflate_players--;
+			if (current_player->replaced) {
+				// Id and lobby slot belong to the resumed connection
+			} else if (current_player->in_valid_lobby() && config::resume_grace > 0 && !is_clean_close(code)) {
+				// Dropped, id stays taken until the slot is resumed or expires
+				size_t lost = (ws->getBufferedAmount() > 0) ? 1 : 0;  // Frames still in the socket buffer are thrown away, counted as one
+				suspend_player(current_player->lobby_shard, current_player->lobby, current_player->id, current_player->topic, std::move(current_player->outbound), lost);
+				current_player->lobby = LobbyHandle();
+			} else {
+				if (current_player->in_valid_lobby()) {
+					current_player->lobby_shard->post_lobby(current_player->lobby, [id = current_player->id](LobbySession *lobby) { lobby->leave(id); });
+					current_player->lobby = LobbyHandle();
+				}
+				PlayerDetails::ids.release(current_player->id);
 			}
 
 			PlayerDetails::num_concurrent_players--;
-			
-			printf("--Disconnected: [%llx]\n", current_player->id);
+
+			log_debug("Disconnected", current_player->id);
 		}
-		
+
 	});  // Set up websocket
 
 	// Set up server status endpoint
 	app.get("/status", [](auto *res, auto *req) {
 		json status = {
-			{"num_players", PlayerDetails::num_concurrent_players},
-			{"num_lobbies", LobbySession::sessions.size()},
-			{"next_player_id", PlayerDetails::last_id + 1}
+			{"num_players", PlayerDetails::num_concurrent_players.load()},
+			{"num_lobbies", LobbySession::num_sessions.load()},
+			{"player_id_bound", PlayerDetails::ids.bound()},
+			{"next_player_id", PlayerDetails::ids.bound()}  // Deprecated name of player_id_bound, kept for existing consumers
 		};
 		res->end(status.dump());
 	});
 
-	// Set up lobby information endpoint
-	app.get("/lobbies", [](auto *res, auto *req) {
-		json lobby_info = {
-			{"lobbies", EMPTY_JSON}
+	// Set up Prometheus metrics endpoint. Per-thread metrics are read directly, labelled by shard.
+	app.get("/metrics", [](auto *res, auto *req) {
+		std::string out;
+		write_header(out, "sgs_players", "gauge", "Connected players");
+		out.append("sgs_players ").append(std::to_string(PlayerDetails::num_concurrent_players.load())).append("\n");
+		write_header(out, "sgs_lobbies", "gauge", "Open lobbies");
+		out.append("sgs_lobbies ").append(std::to_string(LobbySession::num_sessions.load())).append("\n");
+
+		struct CounterMetric {
+			const char *name;
+			const char *help;
+			Counter ShardMetrics::*counter;
+		};
+		static const CounterMetric COUNTERS[] = {
+			{"sgs_messages_in_total", "Frames received from players", &ShardMetrics::messages_in},
+			{"sgs_bytes_in_total", "Bytes received from players", &ShardMetrics::bytes_in},
+			{"sgs_messages_out_total", "Frames sent, a topic publish counts once", &ShardMetrics::messages_out},
+			{"sgs_bytes_out_total", "Bytes sent, a topic publish counts once", &ShardMetrics::bytes_out},
+			{"sgs_relays_total", "Data messages relayed within lobbies", &ShardMetrics::relays},
+			{"sgs_joins_total", "Lobbies created or joined", &ShardMetrics::joins},
+			{"sgs_resumes_total", "Lobby slots resumed after a dropped connection", &ShardMetrics::resumes},
+			{"sgs_errors_total", "Malformed frames and error replies", &ShardMetrics::errors},
+			{"sgs_dropped_total", "Queued or batched messages dropped by the slow consumer policy or replaced by a newer one of their channel", &ShardMetrics::dropped},
+			{"sgs_compressed_total", "Frames sent with permessage-deflate, a topic publish counts once", &ShardMetrics::compressed},
+			{"sgs_compression_sampled_bytes_total", "Size of sampled compressed frames before deflate", &ShardMetrics::sampled_bytes},
+			{"sgs_compression_sampled_deflated_bytes_total", "Size of sampled compressed frames after deflate, without context of earlier frames", &ShardMetrics::sampled_compressed_bytes}
+		};
+		for (const auto &counter : COUNTERS) {
+			write_header(out, counter.name, "counter", counter.help);
+			for (auto *owner : Shard::shards) {
+				write_sample(out, counter.name, "shard=\"" + std::to_string(owner->index) + "\"", (owner->metrics.*counter.counter).get());
+			}
+		}
+
+		struct HistogramMetric {
+			const char *name;
+			const char *help;
+			Histogram ShardMetrics::*histogram;
 		};
-		for (const auto l : LobbySession::sessions) {
-			lobby_info["lobbies"][l.first] = {
-				{"num_players", l.second->num_players()},
-				{"game", l.second->game_name}
+		static const HistogramMetric HISTOGRAMS[] = {
+			{"sgs_handler_latency_nanoseconds", "Time spent handling a received frame", &ShardMetrics::handler_latency},
+			{"sgs_payload_size_bytes", "Size of received frames", &ShardMetrics::payload_size},
+			{"sgs_queue_depth_messages", "Player queue length when a message had to be queued", &ShardMetrics::queue_depth},
+			{"sgs_compressed_send_latency_nanoseconds", "Time spent in a send or publish of a compressed frame, deflate included", &ShardMetrics::compressed_send_time},
+			{"sgs_cross_shard_delay_nanoseconds", "Time tasks from other shards waited to run", &ShardMetrics::cross_shard_delay}
+		};
+		for (const auto &histogram : HISTOGRAMS) {
+			write_header(out, histogram.name, "histogram", histogram.help);
+			for (auto *owner : Shard::shards) {
+				write_histogram(out, histogram.name, "shard=\"" + std::to_string(owner->index) + "\"", owner->metrics.*histogram.histogram);
+			}
+			std::string quantile_name = std::string(histogram.name) + "_quantile";
+			write_header(out, quantile_name.c_str(), "gauge", "Quantile estimates of the histogram");
+			for (auto *owner : Shard::shards) {
+				write_quantiles(out, quantile_name.c_str(), "shard=\"" + std::to_string(owner->index) + "\"", owner->metrics.*histogram.histogram);
+			}
+		}
+
+		write_header(out, "sgs_game_messages_total", "counter", "Data messages relayed by game");
+		for (auto *owner : Shard::shards) {
+			std::lock_guard<std::mutex> lock(owner->metrics.games_mutex);
+			for (const auto &game : owner->metrics.games) {
+				std::string labels = "shard=\"" + std::to_string(owner->index) + "\",game=";
+				write_label_value(labels, game.first);
+				write_sample(out, "sgs_game_messages_total", labels, game.second.messages.get());
+			}
+		}
+		write_header(out, "sgs_game_bytes_total", "counter", "Bytes relayed by game, as received");
+		for (auto *owner : Shard::shards) {
+			std::lock_guard<std::mutex> lock(owner->metrics.games_mutex);
+			for (const auto &game : owner->metrics.games) {
+				std::string labels = "shard=\"" + std::to_string(owner->index) + "\",game=";
+				write_label_value(labels, game.first);
+				write_sample(out, "sgs_game_bytes_total", labels, game.second.bytes.get());
+			}
+		}
+
+		res->writeHeader("Content-Type", "text/plain; version=0.0.4")->end(out);
+	});
+
+	// Set up lobby information endpoint. Every shard lists its own lobbies on its thread.
+	// Optionally filtered by game: /lobbies?game=<game_name>
+	app.get("/lobbies", [=](auto *res, auto *req) {
+		struct LobbyListing {
+			json lobby_info = {
+				{"lobbies", EMPTY_JSON}
 			};
+			size_t remaining = Shard::shards.size();  // Shards which have not answered yet
+			bool aborted = false;
+		};
+		auto listing = std::make_shared<LobbyListing>();
+		res->onAborted([listing]() { listing->aborted = true; });
+		auto game_filter = req->getQuery("game");
+		bool filtered = game_filter.has_value();
+		std::string game_name(game_filter.value_or(""));
+
+		for (auto *owner : Shard::shards) {
+			owner->post([=]() {
+				json lobbies = EMPTY_JSON;
+				auto list_lobby = [&lobbies](const LobbySession *l) {
+					lobbies[l->lobby_name] = {
+						{"num_players", l->num_players()},
+						{"game", l->game_name}
+					};
+				};
+				if (filtered) {
+					auto *game = owner->sessions.find_game(game_name);
+					if (game) {
+						std::for_each(game->lobbies.begin(), game->lobbies.end(), list_lobby);
+					}
+				} else {
+					owner->sessions.for_each(list_lobby);
+				}
+				shard->post([=]() {
+					listing->lobby_info["lobbies"].update(lobbies);
+					if (--listing->remaining == 0 && !listing->aborted) {
+						res->end(dump_json(listing->lobby_info));
+					}
+				});
+			});
 		}
-		
-		res->end(lobby_info.dump());
 	});
 
+	// Wait until every shard can receive tasks before accepting players
+	Shard::num_ready++;
+	while (Shard::num_ready < Shard::shards.size()) {
+		std::this_thread::yield();
+	}
+
 	// Listen on configured port
-	app.listen(config::port, [](auto *listen_socket) {
-		if (listen_socket) {
-			printf("!Running on port: %hu\n", config::port);
+	app.listen(config::port, [=](auto *listen_socket) {
+		if (listen_socket && shard->index == 0) {
+			Logger::log(LogLevel::INFO, "Running", 0, {}, config::port);
 		}
 	});
-	
+
 	app.run();  // Start server
 
 	// This is only executed if server failed to bind
-	printf("!Failed to run on port: %hu\n", config::port);
+	Logger::log(LogLevel::ERROR, "Failed to run", 0, {}, config::port);
+}
+
+int main() {
+	Logger::start(config::debug ? LogLevel::DEBUG : LogLevel::INFO, config::log_rate_limit);
+	if (config::processor_threads > 0) {
+		processor_pool.start(config::processor_threads);
+	}
+
+	unsigned num_threads = config::threads;
+	if (num_threads == 0) {
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (unsigned i = 0; i < num_threads; i++) {
+		Shard::shards.push_back(new Shard(i));
+	}
+
+	std::vector<std::thread> threads;
+	for (auto *shard : Shard::shards) {
+		threads.emplace_back([shard]() { shard->run(); });
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	processor_pool.stop();
+	Logger::stop();
 }
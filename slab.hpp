@@ -0,0 +1,81 @@
+// slab.hpp
+// ========
+// Fixed capacity pool of reusable objects addressed by generation-tagged handles.
+// Objects are built once and recycled, a released slot invalidates all of its old handles.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// Handle to a slab slot. Generations of live slots are odd, so a default handle is never valid.
+struct SlabHandle {
+	uint32_t index = 0;  // Slot index
+	uint32_t generation = 0;  // Generation of slot when handle was made
+
+	bool valid() const {
+		return (this->generation & 1);
+	}
+
+	bool operator==(const SlabHandle &other) const {
+		return (this->index == other.index && this->generation == other.generation);
+	}
+
+	bool operator!=(const SlabHandle &other) const {
+		return !(*this == other);
+	}
+};
+
+// T must be default constructible. Slots are never destroyed, only handed out again.
+template <typename T>
+struct Slab {
+	std::vector<T> slots;  // Reserved up front so slots never move
+	std::vector<uint32_t> generations;  // Current generation of each slot
+	std::vector<uint32_t> free_slots;  // Released slots ready for reuse
+	size_t capacity;  // Maximum number of slots
+
+	explicit Slab(size_t capacity) : capacity(capacity) {
+		this->slots.reserve(capacity);
+		this->generations.reserve(capacity);
+		this->free_slots.reserve(capacity);
+	}
+
+	// Number of live slots
+	size_t size() const {
+		return this->slots.size() - this->free_slots.size();
+	}
+
+	// Take a slot. Returns nullptr if the slab is full.
+	T *acquire(SlabHandle &handle) {
+		uint32_t index;
+		if (!this->free_slots.empty()) {
+			index = this->free_slots.back();
+			this->free_slots.pop_back();
+		} else if (this->slots.size() < this->capacity) {
+			index = static_cast<uint32_t>(this->slots.size());
+			this->slots.emplace_back();
+			this->generations.push_back(0);
+		} else {
+			return nullptr;
+		}
+		handle = {index, ++this->generations[index]};
+		return &this->slots[index];
+	}
+
+	// Return slot of handle. Stale handles are ignored.
+	void release(SlabHandle handle) {
+		if (!this->get(handle)) return;
+		this->generations[handle.index]++;
+		this->free_slots.push_back(handle.index);
+	}
+
+	// Object of handle, nullptr if the handle is stale
+	T *get(SlabHandle handle) {
+		if (!handle.valid() || handle.index >= this->slots.size()) return nullptr;
+		if (this->generations[handle.index] != handle.generation) return nullptr;
+		return &this->slots[handle.index];
+	}
+};
@@ -0,0 +1,113 @@
+// worker_pool.hpp
+// ===============
+// Work-stealing thread pool for tasks too expensive for an event loop.
+// Every worker owns a queue: submitted tasks are spread over the queues, workers take tasks from the
+// front of their own queue and steal from the back of the others when it is empty.
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+struct WorkerPool {
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;  // One per worker
+	std::vector<std::thread> threads;
+	std::atomic<size_t> next_queue = 0;  // Queue receiving the next submitted task
+	std::atomic<size_t> num_pending = 0;  // Tasks submitted but not taken yet
+	std::mutex sleep_mutex;  // Guards sleeping workers against missed wake-ups
+	std::condition_variable wake;
+	bool stopping = false;  // Guarded by sleep_mutex
+
+	// Number of workers, 0 if not started
+	size_t size() const {
+		return this->threads.size();
+	}
+
+	void start(unsigned num_threads) {
+		for (unsigned i = 0; i < num_threads; i++) {
+			this->queues.push_back(std::make_unique<Queue>());
+		}
+		for (unsigned i = 0; i < num_threads; i++) {
+			this->threads.emplace_back([this, i]() { this->work(i); });
+		}
+	}
+
+	// Finish queued tasks and join workers
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(this->sleep_mutex);
+			this->stopping = true;
+		}
+		this->wake.notify_all();
+		for (auto &thread : this->threads) {
+			thread.join();
+		}
+		this->threads.clear();
+	}
+
+	// Queue task to run on some worker. Callable from any thread.
+	void submit(std::function<void()> &&task) {
+		auto &queue = *this->queues[this->next_queue.fetch_add(1, std::memory_order_relaxed) % this->queues.size()];
+		this->num_pending.fetch_add(1, std::memory_order_release);  // Counted first so it never drops below zero
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(this->sleep_mutex);
+		}
+		this->wake.notify_one();
+	}
+
+	// Take a task from queue i, or steal one from another queue
+	bool take(size_t i, std::function<void()> &task) {
+		{
+			auto &own = *this->queues[i];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				task = std::move(own.tasks.front());
+				own.tasks.pop_front();
+				return true;
+			}
+		}
+		for (size_t offset = 1; offset < this->queues.size(); offset++) {
+			auto &other = *this->queues[(i + offset) % this->queues.size()];
+			std::lock_guard<std::mutex> lock(other.mutex);
+			if (!other.tasks.empty()) {
+				task = std::move(other.tasks.back());
+				other.tasks.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void work(size_t i) {
+		std::function<void()> task;
+		while (true) {
+			if (this->take(i, task)) {
+				this->num_pending.fetch_sub(1, std::memory_order_relaxed);
+				task();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(this->sleep_mutex);
+			this->wake.wait(lock, [this]() {
+				return this->stopping || this->num_pending.load(std::memory_order_acquire) > 0;
+			});
+			if (this->stopping && this->num_pending.load(std::memory_order_acquire) == 0) return;
+		}
+	}
+};